@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "parallel.h"
+#include <pthread.h>
+
+#ifdef UBASIC_SINGLE_THREADED
+#error "parallel.c needs -DUBASIC_THREAD_LOCAL=_Thread_local"
+#endif
+
+static pthread_t threads[PARALLEL_MAX_WORKERS];
+static struct ubasic_context contexts[PARALLEL_MAX_WORKERS];
+static int nworkers;
+
+/* Held for a whole PARALLEL FOR, so only one interpreter thread at a time
+   uses the job state and the worker contexts */
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+
+/* The job being run; workers pick it up when generation changes */
+static struct ubasic_parallel_job *job;
+static int job_from, job_to;
+static unsigned long generation;
+static int pending;
+static int stopping;
+
+/*---------------------------------------------------------------------------*/
+static void *worker(void *arg) {
+  int id = (int)(long)arg;
+  unsigned long seen = 0;
+  long n, from, to;
+
+  pthread_mutex_lock(&lock);
+  for(;;) {
+    while(generation == seen && !stopping) pthread_cond_wait(&start_cond, &lock);
+    if(stopping) break;
+    seen = generation;
+    n = (long)job_to - job_from + 1;
+    from = job_from + n * id / nworkers;
+    to = job_from + n * (id + 1) / nworkers - 1;
+    pthread_mutex_unlock(&lock);
+
+    if(from <= to) ubasic_parallel_chunk(job, &contexts[id], from, to);
+
+    pthread_mutex_lock(&lock);
+    if(--pending == 0) pthread_cond_signal(&done_cond);
+  }
+  pthread_mutex_unlock(&lock);
+  return (void*)0;
+}
+
+/*---------------------------------------------------------------------------*/
+int parallel_pool_init(int workers) {
+  if(workers < 1) workers = 1;
+  if(workers > PARALLEL_MAX_WORKERS) workers = PARALLEL_MAX_WORKERS;
+  stopping = 0;
+  for(nworkers = 0; nworkers < workers; nworkers++) {
+    if(pthread_create(&threads[nworkers], (void*)0, worker, (void*)(long)nworkers) != 0) {
+      break;
+    }
+  }
+  if(nworkers == 0) return -1;
+  ubasic_set_parallel_function(parallel_pool_run);
+  return nworkers;
+}
+
+/*---------------------------------------------------------------------------*/
+void parallel_pool_run(struct ubasic_parallel_job *j, int from, int to) {
+  pthread_mutex_lock(&run_lock);
+  pthread_mutex_lock(&lock);
+  job = j;
+  job_from = from;
+  job_to = to;
+  pending = nworkers;
+  generation++;
+  pthread_cond_broadcast(&start_cond);
+  while(pending > 0) pthread_cond_wait(&done_cond, &lock);
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&run_lock);
+}
+
+/*---------------------------------------------------------------------------*/
+void parallel_pool_shutdown(void) {
+  int i;
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&lock);
+  for(i = 0; i < nworkers; i++) pthread_join(threads[i], (void*)0);
+  nworkers = 0;
+  ubasic_set_parallel_function((void*)0);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+#include "scheduler.h"
+
+/*---------------------------------------------------------------------------*/
+static void queue_push(struct sched_queue *q, struct sched_task *task) {
+  task->next = (void*)0;
+  if(q->tail != (void*)0) q->tail->next = task;
+  else q->head = task;
+  q->tail = task;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct sched_task *queue_pop(struct sched_queue *q) {
+  struct sched_task *task = q->head;
+  if(task != (void*)0) {
+    q->head = task->next;
+    if(q->head == (void*)0) q->tail = (void*)0;
+  }
+  return task;
+}
+
+/*---------------------------------------------------------------------------*/
+static void make_ready(struct scheduler *s, struct sched_task *task) {
+  task->state = SCHED_READY;
+  queue_push(&s->ready, task);
+}
+
+/*---------------------------------------------------------------------------*/
+static unsigned int wait_bucket(int event) {
+  unsigned int h = (unsigned int)event * 2654435761u;
+  return (h >> 16) & (SCHED_WAIT_BUCKETS - 1);
+}
+
+/*---------------------------------------------------------------------------*/
+static void wait_push(struct scheduler *s, struct sched_task *task) {
+  struct sched_task **bucket = &s->waiting[wait_bucket(task->wait_event)];
+  struct sched_task *first;
+
+  for(first = *bucket; first != (void*)0; first = first->next_event) {
+    if(first->wait_event == task->wait_event) {
+      queue_push(&first->waiters, task);
+      return;
+    }
+  }
+  task->waiters.head = task->waiters.tail = (void*)0;
+  queue_push(&task->waiters, task);
+  task->next_event = *bucket;
+  *bucket = task;
+}
+
+/*---------------------------------------------------------------------------*/
+void sched_init(struct scheduler *s, int quantum) {
+  int i;
+  s->ready.head = s->ready.tail = (void*)0;
+  for(i = 0; i < SCHED_WHEEL_SLOTS; i++) {
+    s->wheel[i].head = s->wheel[i].tail = (void*)0;
+  }
+  for(i = 0; i < SCHED_WAIT_BUCKETS; i++) {
+    s->waiting[i] = (void*)0;
+  }
+  s->now = 0;
+  s->quantum = quantum > 0 ? quantum : 1;
+  s->live = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+void sched_add(struct scheduler *s, struct sched_task *task, const char *program) {
+  struct ubasic_context *previous = ubasic_current();
+  ubasic_select(&task->context);
+  ubasic_init(program);
+  ubasic_select(previous);
+  s->live++;
+  make_ready(s, task);
+}
+
+/*---------------------------------------------------------------------------*/
+int sched_add_mem(struct scheduler *s, struct sched_task *task, const char *program,
+                  void *mem, unsigned long size) {
+  struct ubasic_context *previous = ubasic_current();
+  int ok;
+  ubasic_select(&task->context);
+  ok = ubasic_init_mem(program, (void*)0, mem, size);
+  ubasic_select(previous);
+  if(!ok) return 0;
+  s->live++;
+  make_ready(s, task);
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+int sched_run_once(struct scheduler *s) {
+  struct ubasic_context *previous;
+  struct sched_task *task;
+  int i, r = UBASIC_RUN_OK;
+  int arg;
+
+  task = queue_pop(&s->ready);
+  if(task == (void*)0) return 0;
+
+  previous = ubasic_current();
+  ubasic_select(&task->context);
+  for(i = 0; i < s->quantum && r == UBASIC_RUN_OK; i++) {
+    r = ubasic_run();
+  }
+  arg = ubasic_wait_argument();
+  ubasic_select(previous);
+
+  switch(r) {
+  case UBASIC_RUN_END:
+    task->state = SCHED_DONE;
+    s->live--;
+    break;
+  case UBASIC_RUN_WAIT:
+    if(arg <= 0) {
+      make_ready(s, task);
+      break;
+    }
+    task->state = SCHED_SLEEPING;
+    task->wake_tick = s->now + arg;
+    queue_push(&s->wheel[task->wake_tick & (SCHED_WHEEL_SLOTS - 1)], task);
+    break;
+  case UBASIC_RUN_WAIT_EVENT:
+    task->state = SCHED_WAITING;
+    task->wait_event = arg;
+    wait_push(s, task);
+    break;
+  default: /* Yielded or used up its time slice */
+    make_ready(s, task);
+    break;
+  }
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+void sched_tick(struct scheduler *s) {
+  struct sched_queue *slot, pending;
+  struct sched_task *task;
+
+  s->now++;
+  slot = &s->wheel[s->now & (SCHED_WHEEL_SLOTS - 1)];
+  pending = *slot;
+  slot->head = slot->tail = (void*)0;
+  /* Tasks sleeping for more than one turn of the wheel go back in */
+  while((task = queue_pop(&pending)) != (void*)0) {
+    if(task->wake_tick <= s->now) make_ready(s, task);
+    else queue_push(slot, task);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+void sched_signal(struct scheduler *s, int event) {
+  struct sched_task **link, *first, *task;
+  struct sched_queue pending;
+
+  link = &s->waiting[wait_bucket(event)];
+  while((first = *link) != (void*)0 && first->wait_event != event) {
+    link = &first->next_event;
+  }
+  if(first == (void*)0) return;
+  *link = first->next_event;
+  pending = first->waiters;
+  while((task = queue_pop(&pending)) != (void*)0) make_ready(s, task);
+}
+
+/*---------------------------------------------------------------------------*/
+int sched_live(struct scheduler *s) {
+  return s->live;
+}
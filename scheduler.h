@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include "ubasic.h"
+
+/* A cooperative scheduler multiplexing many uBASIC programs on one host
+   thread. Programs give up the thread with YIELD and WAIT. Sleeping
+   programs are kept on a timer wheel: a sleep shorter than one turn of the
+   wheel costs O(1), a longer one is looked at again once per turn.
+   Programs blocked in WAIT EVENT are queued per event id, with the ids
+   hashed into buckets, so a signal only walks the distinct ids sharing its
+   bucket and the tasks it wakes. */
+
+#ifndef SCHED_WHEEL_SLOTS
+#define SCHED_WHEEL_SLOTS 64 /* Must be a power of two */
+#endif
+
+#ifndef SCHED_WAIT_BUCKETS
+#define SCHED_WAIT_BUCKETS 64 /* Must be a power of two */
+#endif
+
+enum {
+  SCHED_READY,
+  SCHED_SLEEPING,
+  SCHED_WAITING,
+  SCHED_DONE,
+};
+
+struct sched_task;
+
+struct sched_queue {
+  struct sched_task *head, *tail;
+};
+
+struct sched_task {
+  struct ubasic_context context;
+  struct sched_task *next;
+  unsigned long wake_tick;
+  int wait_event;
+  int state;
+  /* The first task to wait for an event holds the queue of all its
+     waiters, and links to the next such task in the bucket */
+  struct sched_queue waiters;
+  struct sched_task *next_event;
+};
+
+struct scheduler {
+  struct sched_queue ready;
+  struct sched_queue wheel[SCHED_WHEEL_SLOTS];
+  struct sched_task *waiting[SCHED_WAIT_BUCKETS];
+  unsigned long now;
+  int quantum;
+  int live;
+};
+
+/* quantum is the number of lines a task may run before it is preempted at
+   the next line boundary. */
+void sched_init(struct scheduler *s, int quantum);
+void sched_add(struct scheduler *s, struct sched_task *task, const char *program);
+
+/* Like sched_add(), with the task's tables sized from its program and
+   carved out of mem (see ubasic_init_mem()). Returns 0, adding nothing, if
+   they do not fit in size bytes. */
+int sched_add_mem(struct scheduler *s, struct sched_task *task, const char *program,
+                  void *mem, unsigned long size);
+
+/* Run the task at the head of the ready queue for one time slice. Returns
+   0 if no task was ready. */
+int sched_run_once(struct scheduler *s);
+
+/* Advance the clock by one tick, waking tasks whose sleep has expired. */
+void sched_tick(struct scheduler *s);
+
+/* Wake every task blocked in WAIT EVENT event. */
+void sched_signal(struct scheduler *s, int event);
+
+int sched_live(struct scheduler *s);
+
+#endif /* __SCHEDULER_H__ */
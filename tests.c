@@ -30,9 +30,15 @@
  */
 
 #include <time.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 #include "ubasic.h"
+#include "scheduler.h"
+#include "parallel.h"
 
 static const char program_let[] =
 "10 let a = 42\n\
@@ -47,6 +53,60 @@ static const char program_goto[] =
 60 let c = 108\n\
 70 end\n";
 
+static const char program_bad_goto[] =
+"10 goto 99\n\
+20 end\n";
+
+static const char program_fused[] =
+"10 let s = 0\n\
+12 let t = 0\n\
+14 let u = 0\n\
+20 for i = 10 to 1 step -3\n\
+30 let s = s + i\n\
+40 let t = t + 1\n\
+50 next i\n\
+60 if t < 10 then goto 20\n\
+70 u = u - 2\n\
+80 end\n";
+
+static const char program_for_runtime[] =
+"5 let c = 0\n\
+6 let k = 0\n\
+10 for i = 1 to 3\n\
+20 gosub 100\n\
+30 next i\n\
+40 for j = 1 to 2\n\
+50 let c = c + 1\n\
+60 let k = k + 1\n\
+70 if k < 10 then goto 40\n\
+80 next j\n\
+90 end\n\
+100 for j = 1 to 2\n\
+110 let c = c + 1\n\
+120 next j\n\
+130 return\n";
+
+static const char program_recurse[] =
+"10 gosub 20\n\
+20 gosub 20\n";
+
+static const char program_bad_string[] =
+"10 let a$ = 5\n\
+20 end\n";
+
+static const char program_many_events[] =
+"10 for i = 1 to 9\n\
+20 on event i gosub 100\n\
+30 next i\n\
+40 end\n\
+100 return\n";
+
+static const char program_parallel_offset[] =
+"10 parallel for i = 0 to 99\n\
+20 poke i + o, i\n\
+30 next i\n\
+40 end\n";
+
 static const char program_loop[] =
 "10 for i = 0 to 126\n\
 20 for j = 0 to 126\n\
@@ -68,6 +128,39 @@ rem 120 print a, b\n\
 140 next i\n\
 160 end\n";
 
+static const char program_operators[] =
+"10 let a = -5\n\
+20 let c = 0\n\
+30 if a <= -5 and not a >= 0 then let b = 1\n\
+40 let z = 0\n\
+50 if z <> 0 and 10 / z > 1 then let c = 5\n\
+60 if z = 0 or 10 / z > 1 then let c = c + 1\n\
+70 let d = -(2 + 3) * 2\n\
+80 let e = 7 >= 7 = 1 < 2\n\
+90 end\n";
+
+static const char program_if_else[] =
+"10 let a = 0\n\
+20 let b = 0\n\
+30 for i = 1 to 6\n\
+40 if i > 4 then goto 70 else let a = a + 1\n\
+50 if i > 2 then let b = b + 10\n\
+60 next i\n\
+65 end\n\
+70 let b = b + 1\n\
+80 next i\n\
+90 end\n";
+
+static const char program_long_numbers[] =
+"10 goto 1234567890\n\
+44 let a = 2\n\
+45 return\n\
+300 let a = 1\n\
+310 return\n\
+1234567890 let b = 1000000 / 10000\n\
+1234567891 gosub 300\n\
+1234567892 end\n";
+
 static const char program_peek_poke[] =
 "10 peek 100 + 20 + 3, a\n\
 20 peek 123, z\n\
@@ -75,6 +168,70 @@ static const char program_peek_poke[] =
 40 poke 0, 0\n\
 50 end\n";
 
+static const char program_event[] =
+"10 on event 7 gosub 100\n\
+20 let a = a + 1\n\
+30 if e = 0 then goto 20\n\
+40 end\n\
+100 let e = 1\n\
+110 return\n";
+
+static const char program_sleeper[] =
+"10 let a = 1\n\
+20 wait 3\n\
+30 let b = 1\n\
+40 end\n";
+
+static const char program_waiter[] =
+"10 wait event 5\n\
+20 let c = 2\n\
+30 end\n";
+
+static const char program_wait_large[] =
+"10 wait event 200\n\
+20 wait 200\n\
+30 end\n";
+
+static const char program_yielder[] =
+"10 let a = a + 1\n\
+20 yield\n\
+30 if a < 3 then goto 10\n\
+40 end\n";
+
+static const char program_parallel[] =
+"10 parallel for i = 0 to 99\n\
+20 if i % 3 = 0 then poke i, i + 1\n\
+30 poke i + 100, i\n\
+40 next i\n\
+50 end\n";
+
+static const char program_parallel_error[] =
+"10 parallel for i = 0 to 99\n\
+20 if i = 57 then poke a$, 0 else poke i, i\n\
+30 next i\n\
+40 end\n";
+
+static const char program_parallel_shared[] =
+"10 let s = 0\n\
+20 parallel for i = 1 to 10\n\
+30 let s = s + i\n\
+40 next i\n\
+50 end\n";
+
+static const char program_strings[] =
+"10 let a$ = \"hello\"\n\
+20 let b$ = a$ + \", \" + \"world\"\n\
+30 print b$; \" is longer than forty characters when repeated\"\n\
+40 end\n";
+
+static int poked[200];
+static char string_arena[64];
+static char output[128];
+static int output_len;
+
+static struct scheduler sched;
+static struct sched_task tasks[3];
+
 /*---------------------------------------------------------------------------*/
 VARIABLE_TYPE peek(VARIABLE_TYPE arg) {
     return arg;
@@ -85,6 +242,67 @@ void poke(VARIABLE_TYPE arg, VARIABLE_TYPE value) {
     assert(arg == value);
 }
 
+/*---------------------------------------------------------------------------*/
+void poke_record(VARIABLE_TYPE arg, VARIABLE_TYPE value) {
+    poked[(unsigned char)arg] = value;
+}
+
+/*---------------------------------------------------------------------------*/
+void print_record(const char *s, int len) {
+    assert(output_len + len <= (int)sizeof(output));
+    memcpy(output + output_len, s, len);
+    output_len += len;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct ubasic_context parallel_contexts[2];
+static jmp_buf error_jump;
+static const char *error_message;
+
+void error_record(const char *message) {
+  error_message = message;
+  longjmp(error_jump, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+/* Runs program_parallel_offset on a context of its own, poking from the
+   offset in arg */
+static void *parallel_thread(void *arg) {
+  struct ubasic_context *context = arg;
+  ubasic_select(context);
+  ubasic_init(program_parallel_offset);
+  ubasic_set_variable(14, context == &parallel_contexts[0] ? 0 : 100);
+  do {
+    ubasic_run();
+  } while(!ubasic_finished());
+  ubasic_select((void*)0);
+  return (void*)0;
+}
+
+/*---------------------------------------------------------------------------*/
+#if UBASIC_STATS
+static atomic_int monitor_stop;
+static unsigned long monitor_snapshots, monitor_failures, monitor_midway;
+
+/* Snapshots the context in arg until told to stop, checking that every
+   snapshot succeeds and the NEXT count never goes backwards */
+static void *stats_monitor(void *arg) {
+  struct ubasic_stats stats;
+  unsigned long last = 0;
+  while(!atomic_load(&monitor_stop)) {
+    if(!ubasic_stats_snapshot(arg, &stats)) {
+      monitor_failures++;
+      continue;
+    }
+    if(stats.statements[TOKENIZER_NEXT] < last) monitor_failures++;
+    if(stats.statements[TOKENIZER_NEXT] > 0) monitor_midway++;
+    last = stats.statements[TOKENIZER_NEXT];
+    monitor_snapshots++;
+  }
+  return (void*)0;
+}
+#endif
+
 /*---------------------------------------------------------------------------*/
 void run(const char program[]) {
   static int test_num = 0;
@@ -116,19 +334,375 @@ main(void)
   run(program_let);
   assert(ubasic_get_variable(0) == 42);
 
+  {
+    VARIABLE_TYPE bound[MAX_VARNUM] = {0}, all[MAX_VARNUM];
+    assert(ubasic_bind_variables(bound));
+    run(program_fibs);
+    assert(bound[1] == 89);
+    bound[25] = 7;
+    assert(ubasic_get_variable(25) == 7);
+    assert(ubasic_get_variables(all, 0, MAX_VARNUM) == MAX_VARNUM);
+    assert(all[0] == bound[0] && all[8] == 9);
+    assert(ubasic_bind_variables((void*)0));
+    assert(ubasic_set_variables(all, 20, MAX_VARNUM) == MAX_VARNUM - 20);
+    assert(ubasic_get_variable(25) == all[5]);
+  }
+
   run(program_goto);
   assert(ubasic_get_variable(2) == 108);
+#if UBASIC_STATS
+  {
+    struct ubasic_stats stats;
+    assert(ubasic_stats_snapshot(ubasic_current(), &stats));
+    assert(stats.statements[TOKENIZER_GOTO] == 5);
+    assert(stats.jumps == 5 && stats.slow_jumps == 5);
+    assert(stats.index_hits == 0 && stats.index_misses == 5);
+  }
+#endif
+#if UBASIC_TRACE
+  {
+    static const int path[] = {10, 50, 20, 40, 30, 60, 70};
+    struct ubasic_trace_record trace[8];
+    int i;
+    assert(ubasic_trace_copy(trace, 8) == 7);
+    for(i = 0; i < 7; i++) assert(trace[i].line_number == path[i]);
+    assert(trace[0].target == 50);
+    assert(trace[5].variable == 2 && trace[5].value == 108);
+  }
+#endif
+
+  /* A preloaded program jumps through the index from the first GOTO */
+  {
+    static struct ubasic_context template, copy;
+    ubasic_select(&template);
+    ubasic_init(program_goto);
+    ubasic_preload();
+    ubasic_clone(&copy, &template);
+    ubasic_select(&copy);
+    do {
+      ubasic_run();
+    } while(!ubasic_finished());
+    assert(ubasic_get_variable(2) == 108);
+#if UBASIC_STATS
+    struct ubasic_stats stats;
+    assert(ubasic_stats_snapshot(&copy, &stats));
+    assert(stats.index_hits == 5 && stats.slow_jumps == 0);
+#endif
+    ubasic_select((void*)0);
+  }
+
+  /* Fused lines must behave exactly like parsed ones */
+  for(int preload = 0; preload <= 1; preload++) {
+    ubasic_init(program_fused);
+    if(preload) assert(ubasic_preload());
+    do {
+      ubasic_run();
+    } while(!ubasic_finished());
+    assert(ubasic_get_variable(18) == 66);
+    assert(ubasic_get_variable(19) == 12);
+    assert(ubasic_get_variable(20) == -2);
+    assert(ubasic_get_variable(8) == -2);
+#if UBASIC_STATS
+    struct ubasic_stats stats;
+    assert(ubasic_stats_snapshot(ubasic_current(), &stats));
+    assert(stats.fused == (preload ? 28 : 0));
+    assert(stats.statements[TOKENIZER_NEXT] == 12);
+    assert(stats.jumps == 11 && stats.slow_jumps == 0);
+#endif
+  }
+
+  /* Tables carved from a caller's block, sized from the program */
+  {
+    static struct ubasic_context small;
+    static void *mem[128];
+    struct ubasic_layout layout;
+    unsigned long need = ubasic_measure(program_fused, &layout);
+    assert(layout.lines == 10 && layout.for_depth == MAX_FOR_STACK_DEPTH);
+    assert(layout.gosub_depth == 0 && layout.if_skips == 1);
+    assert(need == 10 * sizeof(struct ubasic_line_index) + sizeof(struct ubasic_if_skip) +
+           MAX_FOR_STACK_DEPTH * sizeof(struct ubasic_for_state));
+    assert(layout.context_bytes == sizeof(struct ubasic_context));
+    assert(need <= sizeof(mem));
+
+    ubasic_select(&small);
+    assert(!ubasic_init_mem(program_fused, &layout, mem, need - 1));
+    assert(ubasic_init_mem(program_fused, (void*)0, mem, need));
+    assert(ubasic_preload());
+    do {
+      ubasic_run();
+    } while(!ubasic_finished());
+    assert(ubasic_get_variable(18) == 66);
+
+    /* Nesting decided at run time, and leaving a loop with GOTO, must
+       fit the measured FOR depth */
+    ubasic_measure(program_for_runtime, &layout);
+    layout.for_depth = 2;
+    assert(ubasic_init_mem(program_for_runtime, &layout, mem, sizeof(mem)));
+    do {
+      ubasic_run();
+    } while(!ubasic_finished());
+    assert(ubasic_get_variable(2) == 17);
+
+    /* Recursion needs more than the call sites; overflow is an error */
+    ubasic_measure(program_recurse, &layout);
+    assert(layout.gosub_depth == 2);
+    assert(ubasic_init_mem(program_recurse, &layout, mem, sizeof(mem)));
+    ubasic_set_error_function(error_record);
+    if(setjmp(error_jump) == 0) {
+      do {
+        ubasic_run();
+      } while(!ubasic_finished());
+      assert(0);
+    }
+    assert(strcmp(error_message, "GOSUB stack overflow error\n") == 0);
+    assert(small.gosub_stack_ptr == 2);
+    ubasic_set_error_function((void*)0);
+    ubasic_select((void*)0);
+  }
+
+  /* More lines than the built-in index holds */
+  {
+    static char program_big[16 * 1000];
+    static struct ubasic_line_index index[1000];
+    int n = sprintf(program_big, "1 goto 999\n");
+    for(int i = 2; i < 999; i++) n += sprintf(program_big + n, "%d let b = 1\n", i);
+    sprintf(program_big + n, "999 let a = 7\n1000 end\n");
+
+    ubasic_init(program_big);
+    assert(!ubasic_preload());
+    ubasic_set_line_index(index, 1000);
+    ubasic_init(program_big);
+    assert(ubasic_preload());
+    assert(ubasic_current()->line_index_current_ptr == 1000);
+    do {
+      ubasic_run();
+    } while(!ubasic_finished());
+    assert(ubasic_get_variable(0) == 7);
+#if UBASIC_STATS
+    struct ubasic_stats stats;
+    assert(ubasic_stats_snapshot(ubasic_current(), &stats));
+    assert(stats.index_hits == 1 && stats.slow_jumps == 0);
+#endif
+    ubasic_set_line_index((void*)0, 0);
+  }
+
+  ubasic_set_error_function(error_record);
+  if(setjmp(error_jump) == 0) {
+    run(program_bad_goto);
+    assert(0);
+  }
+  assert(strcmp(error_message, "Line not found error\n") == 0);
+#if UBASIC_STATS
+  /* The error left its line unfinished; the counters stay readable, and
+     so do those of the next program run on the same context */
+  {
+    struct ubasic_stats stats;
+    assert(ubasic_stats_snapshot(ubasic_current(), &stats));
+    assert(stats.statements[TOKENIZER_GOTO] == 1);
+    ubasic_init(program_bad_goto + strlen("10 goto 99\n"));
+    do {
+      ubasic_run();
+    } while(!ubasic_finished());
+    assert(ubasic_stats_snapshot(ubasic_current(), &stats));
+    assert(stats.statements[TOKENIZER_GOTO] == 0 && stats.statements[TOKENIZER_END] == 1);
+  }
+#endif
+  if(setjmp(error_jump) == 0) {
+    run(program_bad_string);
+    assert(0);
+  }
+  assert(strcmp(error_message, "Unexpected token error\n") == 0);
+  if(setjmp(error_jump) == 0) {
+    run(program_many_events);
+    assert(0);
+  }
+  assert(strcmp(error_message, "Too many event handlers error\n") == 0);
+  assert(ubasic_get_variable(8) == MAX_EVENT_HANDLERS + 1);
+  ubasic_set_error_function((void*)0);
 
   run(program_loop);
   assert(ubasic_get_variable(0) == (VARIABLE_TYPE)(126 * 126 * 10));
 
+#if UBASIC_STATS
+  /* Another thread can snapshot the counters while the loop runs */
+  {
+    pthread_t monitor;
+    struct ubasic_stats stats;
+    unsigned long lines = 0;
+    ubasic_init(program_loop);
+    atomic_store(&monitor_stop, 0);
+    assert(pthread_create(&monitor, (void*)0, stats_monitor, ubasic_current()) == 0);
+    do {
+      ubasic_run();
+      if(++lines % 4096 == 0) sched_yield();
+    } while(!ubasic_finished());
+    atomic_store(&monitor_stop, 1);
+    pthread_join(monitor, (void*)0);
+    assert(monitor_failures == 0 && monitor_snapshots > 0 && monitor_midway > 0);
+    assert(ubasic_stats_snapshot(ubasic_current(), &stats));
+    assert(stats.statements[TOKENIZER_NEXT] == 127 * 127 * 11 + 127 * 127 + 127);
+  }
+#endif
+
   run(program_fibs);
   assert(ubasic_get_variable(1) == 89);
 
+  run(program_operators);
+  assert(ubasic_get_variable(0) == -5);
+  assert(ubasic_get_variable(1) == 1);
+  assert(ubasic_get_variable(2) == 1);
+  assert(ubasic_get_variable(3) == -10);
+  assert(ubasic_get_variable(4) == 1);
+
+  run(program_if_else);
+  assert(ubasic_get_variable(0) == 4);
+  assert(ubasic_get_variable(1) == 22);
+
+  /* Line 300 must not alias line 44 any more */
+  run(program_long_numbers);
+  assert(ubasic_get_variable(0) == 1);
+  assert(ubasic_get_variable(1) == 100);
+
   run(program_peek_poke);
   assert(ubasic_get_variable(0) == 123);
   assert(ubasic_get_variable(25) == 123);
 
+  /* The handler must run before the line following the push */
+  ubasic_set_variable(0, 0);
+  ubasic_set_variable(4, 0);
+  ubasic_init(program_event);
+  ubasic_run();
+  assert(ubasic_event_push(ubasic_current(), 7));
+  do {
+    ubasic_run();
+  } while(!ubasic_finished());
+  assert(ubasic_get_variable(0) == 1);
+  assert(ubasic_get_variable(4) == 1);
+
+  ubasic_set_print_function(print_record);
+  ubasic_set_string_arena(string_arena, sizeof(string_arena));
+  run(program_strings);
+  {
+    const char *b;
+    int len;
+    b = ubasic_get_string_variable(1, &len);
+    assert(len == 12 && memcmp(b, "hello, world", 12) == 0);
+    b = ubasic_get_string_variable(0, &len);
+    assert(len == 5 && memcmp(b, "hello", 5) == 0);
+    assert(output_len == 59);
+    assert(memcmp(output, "hello, world is longer than forty characters when repeated\n", 59) == 0);
+  }
+  ubasic_set_print_function((void*)0);
+
+  sched_init(&sched, 100);
+  sched_add(&sched, &tasks[0], program_sleeper);
+  sched_add(&sched, &tasks[1], program_waiter);
+  {
+    static void *task_mem[32];
+    assert(sched_add_mem(&sched, &tasks[2], program_yielder, task_mem, sizeof(task_mem)));
+  }
+  while(sched_run_once(&sched));
+  assert(tasks[0].state == SCHED_SLEEPING);
+  assert(tasks[1].state == SCHED_WAITING);
+  assert(tasks[2].state == SCHED_DONE);
+  sched_signal(&sched, 5);
+  while(sched_run_once(&sched));
+  assert(tasks[1].state == SCHED_DONE);
+  sched_tick(&sched);
+  sched_tick(&sched);
+  assert(!sched_run_once(&sched));
+  sched_tick(&sched);
+  while(sched_run_once(&sched));
+  assert(sched_live(&sched) == 0);
+  ubasic_select(&tasks[0].context);
+  assert(ubasic_get_variable(1) == 1);
+  ubasic_select(&tasks[1].context);
+  assert(ubasic_get_variable(2) == 2);
+  ubasic_select(&tasks[2].context);
+  assert(ubasic_get_variable(0) == 3);
+  ubasic_select((void*)0);
+
+  /* Arguments wider than a variable must not be truncated */
+  sched_init(&sched, 100);
+  sched_add(&sched, &tasks[0], program_wait_large);
+  while(sched_run_once(&sched));
+  assert(tasks[0].state == SCHED_WAITING);
+  sched_signal(&sched, 200);
+  while(sched_run_once(&sched));
+  assert(tasks[0].state == SCHED_SLEEPING);
+  for(int i = 0; i < 199; i++) sched_tick(&sched);
+  assert(!sched_run_once(&sched));
+  sched_tick(&sched);
+  while(sched_run_once(&sched));
+  assert(tasks[0].state == SCHED_DONE);
+
+  /* A signal wakes every waiter of its event and no other */
+  sched_init(&sched, 100);
+  sched_add(&sched, &tasks[0], program_waiter);
+  sched_add(&sched, &tasks[1], program_wait_large);
+  sched_add(&sched, &tasks[2], program_waiter);
+  while(sched_run_once(&sched));
+  sched_signal(&sched, 6);
+  assert(!sched_run_once(&sched));
+  sched_signal(&sched, 5);
+  while(sched_run_once(&sched));
+  assert(tasks[0].state == SCHED_DONE && tasks[2].state == SCHED_DONE);
+  assert(tasks[1].state == SCHED_WAITING);
+  sched_signal(&sched, 5);
+  assert(!sched_run_once(&sched));
+  sched_signal(&sched, 200);
+  while(sched_run_once(&sched));
+  assert(tasks[1].state == SCHED_SLEEPING);
+
+  assert(parallel_pool_init(4) > 0);
+  ubasic_set_poke_function(poke_record);
+  run(program_parallel);
+  assert(ubasic_get_variable(8) == 100);
+  for(int i = 0; i < 100; i++) {
+    assert(poked[i] == (i % 3 == 0 ? i + 1 : 0));
+    assert(poked[i + 100] == i);
+  }
+
+  /* Workers only read a host line index, even one that is not preloaded */
+  {
+    static struct ubasic_line_index index[16];
+    memset(poked, 0, sizeof(poked));
+    ubasic_set_line_index(index, 16);
+    run(program_parallel);
+    for(int i = 0; i < 100; i++) assert(poked[i + 100] == i);
+    ubasic_set_line_index((void*)0, 0);
+  }
+
+  /* Two interpreter threads sharing the pool */
+  {
+    pthread_t threads[2];
+    memset(poked, 0, sizeof(poked));
+    for(int i = 0; i < 2; i++) {
+      assert(pthread_create(&threads[i], (void*)0, parallel_thread, &parallel_contexts[i]) == 0);
+    }
+    for(int i = 0; i < 2; i++) pthread_join(threads[i], (void*)0);
+    for(int i = 0; i < 200; i++) assert(poked[i] == i % 100);
+  }
+
+  /* A failing body is reported on this thread and leaves the pool usable */
+  ubasic_set_error_function(error_record);
+  error_message = (void*)0;
+  if(setjmp(error_jump) == 0) {
+    run(program_parallel_error);
+    assert(0);
+  }
+  assert(error_message != (void*)0 && strcmp(error_message, "Expression error\n") == 0);
+  ubasic_set_error_function((void*)0);
+  memset(poked, 0, sizeof(poked));
+  run(program_parallel);
+  for(int i = 0; i < 100; i++) assert(poked[i + 100] == i);
+
+  /* Writes a shared scalar, so it must fall back to a serial loop */
+  run(program_parallel_shared);
+  assert(ubasic_get_variable(18) == 55);
+  parallel_pool_shutdown();
+  ubasic_set_poke_function((void*)0);
+
   return 0;
 }
 /*---------------------------------------------------------------------------*/
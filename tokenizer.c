@@ -30,6 +30,7 @@
 
 #include "tokenizer.h"
 #include <string.h>
+#include <limits.h>
 
 #define DEBUG 0
 #if DEBUG
@@ -38,17 +39,14 @@
 #define DEBUG_PRINTF(...)
 #endif
 
-static char const *ptr, *nextptr;
-
-#define MAX_NUMLEN 6
+static struct tokenizer_state default_state = {(void*)0, (void*)0, TOKENIZER_ERROR, 0, 0, 0};
+static UBASIC_THREAD_LOCAL struct tokenizer_state *state = &default_state;
 
 struct keyword_token {
   char *keyword;
   int token;
 };
 
-static int current_token = TOKENIZER_ERROR;
-
 static const struct keyword_token keywords[] = {
   {"let", TOKENIZER_LET},
   {"print", TOKENIZER_PRINT},
@@ -66,6 +64,15 @@ static const struct keyword_token keywords[] = {
   {"peek", TOKENIZER_PEEK},
   {"poke", TOKENIZER_POKE},
   {"end", TOKENIZER_END},
+  {"on", TOKENIZER_ON},
+  {"event", TOKENIZER_EVENT},
+  {"yield", TOKENIZER_YIELD},
+  {"wait", TOKENIZER_WAIT},
+  {"parallel", TOKENIZER_PARALLEL},
+  {"step", TOKENIZER_STEP},
+  {"not", TOKENIZER_NOT},
+  {"and", TOKENIZER_LOGAND},
+  {"or", TOKENIZER_LOGOR},
   {(void*)0, TOKENIZER_ERROR}
 };
 
@@ -75,91 +82,103 @@ static int is_digit(char c) {
     return (c >= '0' && c <= '9');
 }
 
-static int custom_atoi(const char *s) {
-    int res = 0;
-    while (is_digit(*s)) {
-        res = res * 10 + (*s - '0');
-        s++;
-    }
-    return res;
-}
-
-static char* custom_strchr(const char *s, int c) {
-    while (*s != (char)c) {
-        if (!*s++) return (void*)0;
-    }
-    return (char *)s;
+/*---------------------------------------------------------------------------*/
+static int singlechar(void) {
+  if(*state->ptr == '\n') return TOKENIZER_CR;
+  if(*state->ptr == ',')  return TOKENIZER_COMMA;
+  if(*state->ptr == ';')  return TOKENIZER_SEMICOLON;
+  if(*state->ptr == '+')  return TOKENIZER_PLUS;
+  if(*state->ptr == '-')  return TOKENIZER_MINUS;
+  if(*state->ptr == '&')  return TOKENIZER_AND;
+  if(*state->ptr == '|')  return TOKENIZER_OR;
+  if(*state->ptr == '*')  return TOKENIZER_ASTR;
+  if(*state->ptr == '/')  return TOKENIZER_SLASH;
+  if(*state->ptr == '%')  return TOKENIZER_MOD;
+  if(*state->ptr == '(')  return TOKENIZER_LEFTPAREN;
+  if(*state->ptr == '#')  return TOKENIZER_HASH;
+  if(*state->ptr == ')')  return TOKENIZER_RIGHTPAREN;
+  if(*state->ptr == '<')  return TOKENIZER_LT;
+  if(*state->ptr == '>')  return TOKENIZER_GT;
+  if(*state->ptr == '=')  return TOKENIZER_EQ;
+  return 0;
 }
 
 /*---------------------------------------------------------------------------*/
-static int singlechar(void) {
-  if(*ptr == '\n') return TOKENIZER_CR;
-  if(*ptr == ',')  return TOKENIZER_COMMA;
-  if(*ptr == ';')  return TOKENIZER_SEMICOLON;
-  if(*ptr == '+')  return TOKENIZER_PLUS;
-  if(*ptr == '-')  return TOKENIZER_MINUS;
-  if(*ptr == '&')  return TOKENIZER_AND;
-  if(*ptr == '|')  return TOKENIZER_OR;
-  if(*ptr == '*')  return TOKENIZER_ASTR;
-  if(*ptr == '/')  return TOKENIZER_SLASH;
-  if(*ptr == '%')  return TOKENIZER_MOD;
-  if(*ptr == '(')  return TOKENIZER_LEFTPAREN;
-  if(*ptr == '#')  return TOKENIZER_HASH;
-  if(*ptr == ')')  return TOKENIZER_RIGHTPAREN;
-  if(*ptr == '<')  return TOKENIZER_LT;
-  if(*ptr == '>')  return TOKENIZER_GT;
-  if(*ptr == '=')  return TOKENIZER_EQ;
+static int doublechar(void) {
+  if(state->ptr[0] == '<' && state->ptr[1] == '=') return TOKENIZER_LE;
+  if(state->ptr[0] == '>' && state->ptr[1] == '=') return TOKENIZER_GE;
+  if(state->ptr[0] == '<' && state->ptr[1] == '>') return TOKENIZER_NE;
   return 0;
 }
 
 /*---------------------------------------------------------------------------*/
 static int get_next_token(void) {
   struct keyword_token const *kt;
-  int i;
-
-  if(*ptr == 0) return TOKENIZER_ENDOFINPUT;
-
-  if(is_digit(*ptr)) {
-    for(i = 0; i < MAX_NUMLEN; ++i) {
-      if(!is_digit(ptr[i])) {
-        if(i > 0) {
-          nextptr = ptr + i;
-          return TOKENIZER_NUMBER;
-        } else return TOKENIZER_ERROR;
+  int i, d;
+
+  state->num = 0;
+  if(*state->ptr == 0) return TOKENIZER_ENDOFINPUT;
+
+  if(is_digit(*state->ptr)) {
+    /* Parsed once here; numbers too large for an int saturate and are
+       flagged for the interpreter to report */
+    state->num_overflow = 0;
+    for(i = 0; is_digit(state->ptr[i]); ++i) {
+      d = state->ptr[i] - '0';
+      if(state->num > (INT_MAX - d) / 10) {
+        state->num = INT_MAX;
+        state->num_overflow = 1;
+      } else {
+        state->num = state->num * 10 + d;
       }
     }
-    return TOKENIZER_ERROR;
+    state->nextptr = state->ptr + i;
+    return TOKENIZER_NUMBER;
+  } else if(doublechar()) {
+    state->nextptr = state->ptr + 2;
+    return doublechar();
   } else if(singlechar()) {
-    nextptr = ptr + 1;
+    state->nextptr = state->ptr + 1;
     return singlechar();
-  } else if(*ptr == '"') {
-    nextptr = ptr;
+  } else if(*state->ptr == '"') {
+    state->nextptr = state->ptr;
     do {
-      ++nextptr;
-    } while(*nextptr != '"' && *nextptr != 0);
-    if (*nextptr == '"') ++nextptr;
+      ++state->nextptr;
+    } while(*state->nextptr != '"' && *state->nextptr != 0);
+    state->string_len = state->nextptr - state->ptr - 1;
+    if (*state->nextptr == '"') ++state->nextptr;
     return TOKENIZER_STRING;
   } else {
     for(kt = keywords; kt->keyword != (void*)0; ++kt) {
-      if(strncmp(ptr, kt->keyword, strlen(kt->keyword)) == 0) {
-        nextptr = ptr + strlen(kt->keyword);
+      if(*state->ptr == kt->keyword[0] &&
+         strncmp(state->ptr, kt->keyword, strlen(kt->keyword)) == 0) {
+        state->nextptr = state->ptr + strlen(kt->keyword);
         return kt->token;
       }
     }
   }
 
-  if(*ptr >= 'a' && *ptr <= 'z') {
-    nextptr = ptr + 1;
+  if(*state->ptr >= 'a' && *state->ptr <= 'z') {
+    if(state->ptr[1] == '$') {
+      state->nextptr = state->ptr + 2;
+      return TOKENIZER_STRINGVARIABLE;
+    }
+    state->nextptr = state->ptr + 1;
     return TOKENIZER_VARIABLE;
   }
 
   return TOKENIZER_ERROR;
 }
 
+/*---------------------------------------------------------------------------*/
+void tokenizer_set_state(struct tokenizer_state *s) {
+  state = s != (void*)0 ? s : &default_state;
+}
+
 /*---------------------------------------------------------------------------*/
 void tokenizer_goto(const char *program) {
-  ptr = program;
-  current_token = get_next_token();
+  state->ptr = program;
+  state->current_token = get_next_token();
 }
 
 /*---------------------------------------------------------------------------*/
@@ -169,50 +188,59 @@ void tokenizer_init(const char *program) {
 
 /*---------------------------------------------------------------------------*/
 int tokenizer_token(void) {
-  return current_token;
+  return state->current_token;
 }
 
 /*---------------------------------------------------------------------------*/
 void tokenizer_next(void) {
   if(tokenizer_finished()) return;
 
-  ptr = nextptr;
-  while(*ptr == ' ' || *ptr == '\t' || *ptr == '\r') {
-    ++ptr;
+  state->ptr = state->nextptr;
+  while(*state->ptr == ' ' || *state->ptr == '\t' || *state->ptr == '\r') {
+    ++state->ptr;
   }
-  current_token = get_next_token();
+  state->current_token = get_next_token();
 
-  if(current_token == TOKENIZER_REM) {
-      while(!(*nextptr == '\n' || *nextptr == 0)) {
-        ++nextptr;
+  if(state->current_token == TOKENIZER_REM) {
+      while(!(*state->nextptr == '\n' || *state->nextptr == 0)) {
+        ++state->nextptr;
       }
-      if(*nextptr == '\n') ++nextptr;
+      if(*state->nextptr == '\n') ++state->nextptr;
       tokenizer_next();
   }
 }
 
 /*---------------------------------------------------------------------------*/
-VARIABLE_TYPE tokenizer_num(void) {
-  return (VARIABLE_TYPE)custom_atoi(ptr);
+int tokenizer_num(void) {
+  return state->num;
+}
+
+/*---------------------------------------------------------------------------*/
+int tokenizer_num_overflow(void) {
+  return state->current_token == TOKENIZER_NUMBER && state->num_overflow;
 }
 
 /*---------------------------------------------------------------------------*/
 void tokenizer_string(char *dest, int len) {
-  char *string_end;
+  char const *string_start;
   int string_len;
 
-  if(tokenizer_token() != TOKENIZER_STRING) return;
-
-  string_end = custom_strchr(ptr + 1, '"');
-  if(string_end == (void*)0) return;
+  string_start = tokenizer_string_slice(&string_len);
+  if(string_start == (void*)0) return;
 
-  string_len = string_end - ptr - 1;
-  if(len < string_len) string_len = len;
+  if(len - 1 < string_len) string_len = len - 1;
 
-  memcpy(dest, ptr + 1, string_len);
+  memcpy(dest, string_start, string_len);
   dest[string_len] = 0;
 }
 
+/*---------------------------------------------------------------------------*/
+char const *tokenizer_string_slice(int *len) {
+  if(tokenizer_token() != TOKENIZER_STRING) return (void*)0;
+  *len = state->string_len;
+  return state->ptr + 1;
+}
+
 /*---------------------------------------------------------------------------*/
 void tokenizer_error_print(void) {
   // Can be mapped to Circle Logger if needed
@@ -220,15 +248,15 @@ void tokenizer_error_print(void) {
 
 /*---------------------------------------------------------------------------*/
 int tokenizer_finished(void) {
-  return *ptr == 0 || current_token == TOKENIZER_ENDOFINPUT;
+  return *state->ptr == 0 || state->current_token == TOKENIZER_ENDOFINPUT;
 }
 
 /*---------------------------------------------------------------------------*/
 int tokenizer_variable_num(void) {
-  return *ptr - 'a';
+  return *state->ptr - 'a';
 }
 
 /*---------------------------------------------------------------------------*/
 char const * tokenizer_pos(void) {
-    return ptr;
+    return state->ptr;
 }
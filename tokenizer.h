@@ -32,12 +32,21 @@
 
 #include "vartype.h"
 
+/* Storage class of the pointers to the currently selected interpreter and
+   tokenizer state. Hosts running interpreters on several threads build
+   with -DUBASIC_THREAD_LOCAL=_Thread_local. */
+#ifndef UBASIC_THREAD_LOCAL
+#define UBASIC_THREAD_LOCAL
+#define UBASIC_SINGLE_THREADED 1 /* Checked by the multi-threaded hosts */
+#endif
+
 enum {
   TOKENIZER_ERROR,
   TOKENIZER_ENDOFINPUT,
   TOKENIZER_NUMBER,
   TOKENIZER_STRING,
   TOKENIZER_VARIABLE,
+  TOKENIZER_STRINGVARIABLE,
   TOKENIZER_LET,
   TOKENIZER_PRINT,
   TOKENIZER_IF,
@@ -54,6 +63,12 @@ enum {
   TOKENIZER_PEEK,
   TOKENIZER_POKE,
   TOKENIZER_END,
+  TOKENIZER_ON,
+  TOKENIZER_EVENT,
+  TOKENIZER_YIELD,
+  TOKENIZER_WAIT,
+  TOKENIZER_PARALLEL,
+  TOKENIZER_STEP,
   TOKENIZER_COMMA,
   TOKENIZER_SEMICOLON,
   TOKENIZER_PLUS,
@@ -69,16 +84,34 @@ enum {
   TOKENIZER_LT,
   TOKENIZER_GT,
   TOKENIZER_EQ,
+  TOKENIZER_LE,
+  TOKENIZER_GE,
+  TOKENIZER_NE,
+  TOKENIZER_NOT,
+  TOKENIZER_LOGAND,
+  TOKENIZER_LOGOR,
   TOKENIZER_CR,
+  TOKENIZER_NUM_TOKENS /* Keep last */
+};
+
+struct tokenizer_state {
+  char const *ptr, *nextptr;
+  int current_token;
+  int string_len; /* Length of the current string literal */
+  int num;        /* Value of the current number, parsed when lexed */
+  int num_overflow;
 };
 
+void tokenizer_set_state(struct tokenizer_state *state);
 void tokenizer_goto(const char *program);
 void tokenizer_init(const char *program);
 void tokenizer_next(void);
 int tokenizer_token(void);
-VARIABLE_TYPE tokenizer_num(void);
+int tokenizer_num(void);
+int tokenizer_num_overflow(void);
 int tokenizer_variable_num(void);
 void tokenizer_string(char *dest, int len);
+char const *tokenizer_string_slice(int *len);
 
 int tokenizer_finished(void);
 void tokenizer_error_print(void);
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/* Decodes a trace file written by a host built with UBASIC_TRACE=1: prints
+   the execution path and the most frequently taken line-to-line edges. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "ubasic.h"
+
+#define MAX_EDGES 4096
+#define HOT_EDGES 20
+
+struct edge {
+  int from, to;
+  unsigned long count;
+};
+
+static struct edge edges[MAX_EDGES];
+static int nedges;
+
+/*---------------------------------------------------------------------------*/
+static const char *token_name(int token) {
+  switch(token) {
+  case TOKENIZER_LET:
+  case TOKENIZER_VARIABLE:
+  case TOKENIZER_STRINGVARIABLE: return "let";
+  case TOKENIZER_PRINT:    return "print";
+  case TOKENIZER_IF:       return "if";
+  case TOKENIZER_FOR:      return "for";
+  case TOKENIZER_NEXT:     return "next";
+  case TOKENIZER_GOTO:     return "goto";
+  case TOKENIZER_GOSUB:    return "gosub";
+  case TOKENIZER_RETURN:   return "return";
+  case TOKENIZER_PEEK:     return "peek";
+  case TOKENIZER_POKE:     return "poke";
+  case TOKENIZER_END:      return "end";
+  case TOKENIZER_ON:       return "on";
+  case TOKENIZER_YIELD:    return "yield";
+  case TOKENIZER_WAIT:     return "wait";
+  case TOKENIZER_PARALLEL: return "parallel";
+  default:                 return "?";
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void edge_add(int from, int to) {
+  int i;
+  for(i = 0; i < nedges; i++) {
+    if(edges[i].from == from && edges[i].to == to) {
+      edges[i].count++;
+      return;
+    }
+  }
+  if(nedges < MAX_EDGES) {
+    edges[nedges].from = from;
+    edges[nedges].to = to;
+    edges[nedges].count = 1;
+    nedges++;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static int edge_compare(const void *a, const void *b) {
+  const struct edge *ea = a, *eb = b;
+  if(ea->count != eb->count) return ea->count < eb->count ? 1 : -1;
+  if(ea->from != eb->from) return ea->from < eb->from ? -1 : 1;
+  if(ea->to != eb->to) return ea->to < eb->to ? -1 : 1;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+int
+main(int argc, char *argv[])
+{
+  struct ubasic_trace_header header;
+  struct ubasic_trace_record r, prev;
+  unsigned int i;
+  int quiet = 0;
+  FILE *f;
+
+  if(argc > 2 && argv[1][0] == '-' && argv[1][1] == 'q') {
+    quiet = 1;
+    argv++;
+    argc--;
+  }
+  if(argc != 2) {
+    fprintf(stderr, "usage: trace-decode [-q] <trace file>\n");
+    return 2;
+  }
+  f = fopen(argv[1], "rb");
+  if(f == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  if(fread(&header, sizeof(header), 1, f) != 1 ||
+     header.magic != UBASIC_TRACE_MAGIC ||
+     header.record_size != sizeof(struct ubasic_trace_record)) {
+    fprintf(stderr, "%s: not a uBASIC trace file\n", argv[1]);
+    return 1;
+  }
+
+  for(i = 0; i < header.count && fread(&r, sizeof(r), 1, f) == 1; i++) {
+    if(!quiet) {
+      printf("%d %s", r.line_number, token_name(r.token));
+      if(r.variable != 0xff) printf(" %c=%d", 'a' + r.variable, r.value);
+      if(r.target >= 0) printf(" -> %d", r.target);
+      printf("\n");
+    }
+    if(i > 0) edge_add(prev.line_number, r.line_number);
+    prev = r;
+  }
+  fclose(f);
+
+  qsort(edges, nedges, sizeof(edges[0]), edge_compare);
+  printf("%u records, hot edges:\n", i);
+  for(i = 0; i < (unsigned int)nedges && i < HOT_EDGES; i++) {
+    printf("%8lu  %d -> %d\n", edges[i].count, edges[i].from, edges[i].to);
+  }
+  return 0;
+}
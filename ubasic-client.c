@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/* ubasic-client: sends a program to ubasic-server and prints its output,
+   or with -n drives the server with repeated requests from -c concurrent
+   connections and reports throughput and latency. After the first run a
+   program is sent by hash only. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_SOCKET "/tmp/ubasic.sock"
+#define MAX_SETS 26
+#define MAX_CLIENTS 256
+
+static const char *socket_path = DEFAULT_SOCKET;
+static char *program;
+static long program_length;
+static long statement_limit, time_limit_ms;
+static char set_lines[MAX_SETS][48];
+static int nsets;
+static int quiet;
+
+static long requests_per_client;
+static long *latencies;
+static long failures;
+static pthread_mutex_t failures_lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct connection {
+  int fd;
+  char buf[4096];
+  int pos, len;
+  char hash[32];
+};
+
+/*---------------------------------------------------------------------------*/
+static int write_all(int fd, const char *s, long len) {
+  long n;
+  while(len > 0) {
+    n = write(fd, s, len);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int fill(struct connection *c) {
+  int n;
+  if(c->pos > 0) {
+    memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+    c->len -= c->pos;
+    c->pos = 0;
+  }
+  do {
+    n = read(c->fd, c->buf + c->len, sizeof(c->buf) - c->len);
+  } while(n < 0 && errno == EINTR);
+  if(n <= 0) return -1;
+  c->len += n;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int read_line(struct connection *c, char *line, int size) {
+  char *nl;
+  int n;
+  while((nl = memchr(c->buf + c->pos, '\n', c->len - c->pos)) == NULL) {
+    if(c->len - c->pos >= size - 1 || fill(c) < 0) return -1;
+  }
+  n = nl - (c->buf + c->pos);
+  memcpy(line, c->buf + c->pos, n);
+  line[n] = 0;
+  c->pos += n + 1;
+  return n;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Copies len bytes of output to out, or drops them when out is NULL */
+static int read_output(struct connection *c, long len, FILE *out) {
+  long n;
+  while(len > 0) {
+    if(c->pos == c->len && fill(c) < 0) return -1;
+    n = c->len - c->pos < len ? c->len - c->pos : len;
+    if(out != NULL) fwrite(c->buf + c->pos, 1, n, out);
+    c->pos += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int connect_server(struct connection *c) {
+  struct sockaddr_un addr;
+  c->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(c->fd < 0) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+  if(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(c->fd);
+    return -1;
+  }
+  c->pos = c->len = 0;
+  c->hash[0] = 0;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Runs the program once; returns 0 if it finished with status ok */
+static int request(struct connection *c, FILE *out) {
+  char line[512], status[32];
+  long len;
+  int i;
+
+  for(i = 0; i < nsets; i++) {
+    if(write_all(c->fd, set_lines[i], strlen(set_lines[i])) < 0) return -1;
+  }
+  if(c->hash[0] != 0) {
+    snprintf(line, sizeof(line), "EXEC %s %ld %ld\n", c->hash, statement_limit, time_limit_ms);
+    if(write_all(c->fd, line, strlen(line)) < 0) return -1;
+  } else {
+    snprintf(line, sizeof(line), "RUN %ld %ld %ld\n", statement_limit, time_limit_ms, program_length);
+    if(write_all(c->fd, line, strlen(line)) < 0 ||
+       write_all(c->fd, program, program_length) < 0) return -1;
+  }
+
+  while(read_line(c, line, sizeof(line)) >= 0) {
+    if(sscanf(line, "OUT %ld", &len) == 1) {
+      if(read_output(c, len, out) < 0) return -1;
+    } else if(sscanf(line, "HASH %31s", c->hash) == 1) {
+    } else if(strncmp(line, "DONE ", 5) == 0) {
+      if(out != NULL) fprintf(stderr, "%s\n", line);
+      if(sscanf(line, "DONE %31s", status) != 1) return -1;
+      if(strcmp(status, "no-program") == 0) c->hash[0] = 0;
+      return strcmp(status, "ok") == 0 ? 0 : -1;
+    } else if(out != NULL) {
+      fprintf(stderr, "%s\n", line);
+    }
+  }
+  return -1;
+}
+
+/*---------------------------------------------------------------------------*/
+static long now_us(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000L + t.tv_nsec / 1000;
+}
+
+/*---------------------------------------------------------------------------*/
+static void *client_main(void *arg) {
+  long *lat = arg;
+  struct connection c;
+  long i, start, failed = 0;
+
+  if(connect_server(&c) < 0) {
+    perror(socket_path);
+    failed = requests_per_client;
+  } else {
+    for(i = 0; i < requests_per_client; i++) {
+      start = now_us();
+      if(request(&c, NULL) < 0) failed++;
+      lat[i] = now_us() - start;
+    }
+    close(c.fd);
+  }
+  pthread_mutex_lock(&failures_lock);
+  failures += failed;
+  pthread_mutex_unlock(&failures_lock);
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+static int compare_long(const void *a, const void *b) {
+  long x = *(const long *)a, y = *(const long *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*---------------------------------------------------------------------------*/
+static int load(long requests, int clients) {
+  pthread_t threads[MAX_CLIENTS];
+  long total, start, elapsed;
+  int i;
+
+  requests_per_client = (requests + clients - 1) / clients;
+  total = requests_per_client * clients;
+  latencies = calloc(total, sizeof(long));
+  if(latencies == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  start = now_us();
+  for(i = 0; i < clients; i++) {
+    pthread_create(&threads[i], NULL, client_main, latencies + i * requests_per_client);
+  }
+  for(i = 0; i < clients; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  elapsed = now_us() - start;
+
+  qsort(latencies, total, sizeof(long), compare_long);
+  printf("%ld requests, %d clients, %ld failed\n", total, clients, failures);
+  printf("%.0f requests/s\n", elapsed > 0 ? total * 1e6 / elapsed : 0.0);
+  printf("latency us: p50 %ld  p90 %ld  p99 %ld  max %ld\n",
+         latencies[total / 2], latencies[total * 9 / 10],
+         latencies[total * 99 / 100], latencies[total - 1]);
+  return failures != 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int read_program(const char *path) {
+  FILE *f = fopen(path, "rb");
+  long size = 0, n;
+  if(f == NULL) return -1;
+  program = NULL;
+  do {
+    program = realloc(program, size + 65536);
+    if(program == NULL) return -1;
+    n = fread(program + size, 1, 65536, f);
+    size += n;
+  } while(n > 0);
+  fclose(f);
+  program_length = size;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+int
+main(int argc, char *argv[])
+{
+  struct connection c;
+  long requests = 0, value;
+  int clients = 1, opt, r;
+  char name;
+
+  while((opt = getopt(argc, argv, "s:v:l:t:n:c:q")) != -1) {
+    switch(opt) {
+    case 's': socket_path = optarg; break;
+    case 'v':
+      if(nsets == MAX_SETS || sscanf(optarg, "%c=%ld", &name, &value) != 2) {
+        fprintf(stderr, "bad variable %s, expected name=value\n", optarg);
+        return 2;
+      }
+      snprintf(set_lines[nsets++], sizeof(set_lines[0]), "SET %c %ld\n", name, value);
+      break;
+    case 'l': statement_limit = atol(optarg); break;
+    case 't': time_limit_ms = atol(optarg); break;
+    case 'n': requests = atol(optarg); break;
+    case 'c': clients = atoi(optarg); break;
+    case 'q': quiet = 1; break;
+    default:
+      goto usage;
+    }
+  }
+  if(optind != argc - 1) goto usage;
+  if(read_program(argv[optind]) < 0) {
+    perror(argv[optind]);
+    return 1;
+  }
+  if(clients < 1) clients = 1;
+  if(clients > MAX_CLIENTS) clients = MAX_CLIENTS;
+
+  if(requests > 0) return load(requests, clients);
+
+  if(connect_server(&c) < 0) {
+    perror(socket_path);
+    return 1;
+  }
+  r = request(&c, quiet ? NULL : stdout);
+  close(c.fd);
+  return r < 0;
+
+ usage:
+  fprintf(stderr, "usage: ubasic-client [-s socket] [-v name=value]... [-l statements] [-t ms]\n"
+                  "                     [-n requests [-c clients]] [-q] program.bas\n");
+  return 2;
+}
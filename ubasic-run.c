@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/* ubasic-run: runs a .bas file straight from a read-only memory mapping.
+   The interpreter's tables are sized from the program and every line is
+   indexed before it starts, so programs of any length jump without
+   rescanning. Load time (mapping, sizing and indexing), run time and the
+   memory footprint are reported separately on stderr. */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ubasic.h"
+
+/*---------------------------------------------------------------------------*/
+void circle_basic_print(const char *s) {
+  fputs(s, stdout);
+}
+
+/*---------------------------------------------------------------------------*/
+void circle_basic_print_num(int n) {
+  printf("%d", n);
+}
+
+/*---------------------------------------------------------------------------*/
+static void print_output(const char *s, int len) {
+  fwrite(s, 1, len, stdout);
+}
+
+/*---------------------------------------------------------------------------*/
+static void discard_output(const char *s, int len) {
+  (void)s;
+  (void)len;
+}
+
+/*---------------------------------------------------------------------------*/
+static void program_error(const char *message) {
+  fflush(stdout);
+  fprintf(stderr, "error: %s", message);
+  exit(1);
+}
+
+/*---------------------------------------------------------------------------*/
+static double elapsed(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Maps the file read-only with at least one zero byte after it, so the
+   tokenizer sees a terminated string without the text being copied: the
+   file is mapped over an anonymous mapping one byte longer. */
+static const char *map_program(const char *path, size_t *size) {
+  struct stat st;
+  char *base;
+  void *text;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if(fd < 0 || fstat(fd, &st) < 0) return NULL;
+  *size = st.st_size;
+  base = mmap(NULL, *size + 1, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(base == MAP_FAILED) return NULL;
+  if(*size > 0) {
+    text = mmap(base, *size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+    if(text == MAP_FAILED) return NULL;
+  }
+  close(fd);
+  return base;
+}
+
+/*---------------------------------------------------------------------------*/
+static void report_footprint(const struct ubasic_layout *layout) {
+  fprintf(stderr, "footprint %lu bytes: context %lu, tables %lu\n",
+          layout->context_bytes + layout->table_bytes, layout->context_bytes, layout->table_bytes);
+  fprintf(stderr, "  line index %d x %zu = %lu\n", layout->lines,
+          sizeof(struct ubasic_line_index), layout->line_index_bytes);
+  fprintf(stderr, "  if cache   %d x %zu = %lu\n", layout->if_skips,
+          sizeof(struct ubasic_if_skip), layout->if_skip_bytes);
+  fprintf(stderr, "  for stack  %d x %zu = %lu\n", layout->for_depth,
+          sizeof(struct ubasic_for_state), layout->for_bytes);
+  fprintf(stderr, "  gosub stack %d x %zu = %lu\n", layout->gosub_depth,
+          sizeof(int), layout->gosub_bytes);
+}
+
+/*---------------------------------------------------------------------------*/
+int
+main(int argc, char *argv[])
+{
+  struct ubasic_layout layout;
+  struct timespec start;
+  void *tables;
+  const char *text;
+  double load_time, run_time;
+  size_t size;
+  long statements = 0;
+  int opt, quiet = 0, gosub_depth = -1, for_depth = -1;
+
+  while((opt = getopt(argc, argv, "f:g:q")) != -1) {
+    switch(opt) {
+    case 'f': for_depth = atoi(optarg); break;
+    case 'g': gosub_depth = atoi(optarg); break;
+    case 'q': quiet = 1; break;
+    default: goto usage;
+    }
+  }
+  if(optind != argc - 1) goto usage;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  text = map_program(argv[optind], &size);
+  if(text == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  ubasic_measure(text, &layout);
+  if(gosub_depth >= 0) {
+    layout.table_bytes += (gosub_depth - layout.gosub_depth) * sizeof(int);
+    layout.gosub_bytes = gosub_depth * sizeof(int);
+    layout.gosub_depth = gosub_depth;
+  }
+  if(for_depth >= 0) {
+    layout.table_bytes += (for_depth - layout.for_depth) * sizeof(struct ubasic_for_state);
+    layout.for_bytes = for_depth * sizeof(struct ubasic_for_state);
+    layout.for_depth = for_depth;
+  }
+  tables = malloc(layout.table_bytes > 0 ? layout.table_bytes : 1);
+  if(tables == NULL || !ubasic_init_mem(text, &layout, tables, layout.table_bytes)) {
+    fprintf(stderr, "cannot allocate %lu bytes of tables\n", layout.table_bytes);
+    return 1;
+  }
+  ubasic_set_error_function(program_error);
+  ubasic_set_print_function(quiet ? discard_output : print_output);
+  ubasic_preload();
+  load_time = elapsed(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  /* Nothing here sends events or ticks, so WAIT and YIELD just continue */
+  do {
+    statements++;
+  } while(ubasic_run() != UBASIC_RUN_END);
+  run_time = elapsed(&start);
+  fflush(stdout);
+
+  fprintf(stderr, "%zu bytes, %d lines indexed\n", size, ubasic_current()->line_index_current_ptr);
+  fprintf(stderr, "load %.6f s, run %.6f s, %ld lines executed\n", load_time, run_time, statements);
+  report_footprint(&layout);
+  free(tables);
+  return 0;
+
+ usage:
+  fprintf(stderr, "usage: ubasic-run [-q] [-f for-depth] [-g gosub-depth] program.bas\n");
+  return 2;
+}
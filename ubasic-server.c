@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2006, Adam Dunkels
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the author nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ */
+
+/* ubasic-server: runs uBASIC programs for local clients over a Unix domain
+   socket on a pool of worker threads, each with a pre-initialized
+   interpreter context. Programs are cached by content hash with their line
+   index already built, so a repeated program is only copied, never parsed
+   again.
+
+   Requests, one after another on a connection:
+
+     SET <variable> <value>\n                 set a variable for the next run
+     RUN <statements> <ms> <length>\n<text>   run program text
+     EXEC <hash> <statements> <ms>\n          run a cached program by hash
+
+   A limit of 0 selects the server default. Responses:
+
+     OUT <length>\n<bytes>                    program output, streamed
+     HASH <hash>\n                            key for EXEC
+     ERROR <message>\n                        the program failed
+     VARS <a> <b> ... <z>\n                   final variables
+     DONE <status> <statements> <usec>\n      status is ok, statement-limit,
+                                              time-limit, error, no-program,
+                                              no-memory or bad-request
+
+   Programs are only ever sent as text; there is no precompiled image
+   format. The prepared form of a program is its line index, which points
+   into the text and the server's own memory, so it cannot be shipped.
+   Instead a client sends the text once and reruns it with EXEC, which
+   skips the upload and the compile. */
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "ubasic.h"
+
+#ifdef UBASIC_SINGLE_THREADED
+#error "ubasic-server.c needs -DUBASIC_THREAD_LOCAL=_Thread_local"
+#endif
+
+#define DEFAULT_SOCKET "/tmp/ubasic.sock"
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 256
+#define MAX_PROGRAM_SIZE (16 * 1024 * 1024)
+#define DEFAULT_STATEMENT_LIMIT 100000000L
+#define DEFAULT_TIME_LIMIT_MS 10000L
+#define TIME_CHECK_INTERVAL 1024
+#define CACHE_SIZE 128
+#define CONNECTION_QUEUE 64
+#define STRING_ARENA_SIZE 4096
+#define OUTPUT_BUFFER 4096
+
+struct cached_program {
+  unsigned long long hash;
+  char *text;
+  long length;
+  int users;
+  unsigned long last_used;
+  struct ubasic_layout layout;
+  void *tables;
+  struct ubasic_context template;
+};
+
+struct reader {
+  int fd;
+  char buf[4096];
+  int pos, len;
+};
+
+struct worker {
+  pthread_t thread;
+  struct ubasic_context context;
+  void *stacks; /* Sized for the largest program run so far */
+  unsigned long stacks_size;
+  char string_arena[STRING_ARENA_SIZE];
+};
+
+static struct cached_program cache[CACHE_SIZE];
+static unsigned long cache_clock;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int connections[CONNECTION_QUEUE];
+static int connections_head, connections_count;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* Where the program running on this thread sends output and errors */
+static _Thread_local int out_fd;
+static _Thread_local char out_buf[OUTPUT_BUFFER];
+static _Thread_local int out_len;
+static _Thread_local jmp_buf error_jump;
+static _Thread_local const char *error_message;
+
+/*---------------------------------------------------------------------------*/
+static int write_all(int fd, const char *s, long len) {
+  long n;
+  while(len > 0) {
+    n = write(fd, s, len);
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return -1;
+    }
+    s += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void out_flush(void) {
+  char header[32];
+  if(out_len == 0) return;
+  snprintf(header, sizeof(header), "OUT %d\n", out_len);
+  write_all(out_fd, header, strlen(header));
+  write_all(out_fd, out_buf, out_len);
+  out_len = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static void print_output(const char *s, int len) {
+  int n;
+  while(len > 0) {
+    if(out_len == OUTPUT_BUFFER) out_flush();
+    n = OUTPUT_BUFFER - out_len < len ? OUTPUT_BUFFER - out_len : len;
+    memcpy(out_buf + out_len, s, n);
+    out_len += n;
+    s += n;
+    len -= n;
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+void circle_basic_print(const char *s) {
+  print_output(s, strlen(s));
+}
+
+/*---------------------------------------------------------------------------*/
+void circle_basic_print_num(int n) {
+  char buf[16];
+  print_output(buf, snprintf(buf, sizeof(buf), "%d", n));
+}
+
+/*---------------------------------------------------------------------------*/
+static void program_error(const char *message) {
+  error_message = message;
+  longjmp(error_jump, 1);
+}
+
+/*---------------------------------------------------------------------------*/
+static int reader_fill(struct reader *r) {
+  int n;
+  if(r->pos > 0) {
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+  }
+  do {
+    n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+  } while(n < 0 && errno == EINTR);
+  if(n <= 0) return -1;
+  r->len += n;
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static int read_line(struct reader *r, char *line, int size) {
+  char *nl;
+  int n;
+  for(;;) {
+    nl = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+    if(nl != NULL) break;
+    if(r->len - r->pos >= size - 1 || reader_fill(r) < 0) return -1;
+  }
+  n = nl - (r->buf + r->pos);
+  if(n >= size) return -1;
+  memcpy(line, r->buf + r->pos, n);
+  line[n] = 0;
+  r->pos += n + 1;
+  return n;
+}
+
+/*---------------------------------------------------------------------------*/
+static int read_exact(struct reader *r, char *dest, long len) {
+  long n;
+  while(len > 0) {
+    if(r->pos == r->len && reader_fill(r) < 0) return -1;
+    n = r->len - r->pos < len ? r->len - r->pos : len;
+    memcpy(dest, r->buf + r->pos, n);
+    r->pos += n;
+    dest += n;
+    len -= n;
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*/
+static unsigned long long hash_text(const char *s, long len) {
+  unsigned long long h = 14695981039346656037ULL;
+  while(len-- > 0) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cached_program *cache_find(unsigned long long hash,
+                                         const char *text, long length) {
+  int i;
+  for(i = 0; i < CACHE_SIZE; i++) {
+    if(cache[i].text != NULL && cache[i].hash == hash &&
+       (text == NULL || (cache[i].length == length &&
+                         memcmp(cache[i].text, text, length) == 0))) {
+      return &cache[i];
+    }
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/* Returns the cache entry for a program, compiling it if needed, with a
+   reference held; text is freed or taken over. NULL if the cache is full
+   of programs in use or the program could not be compiled. The slot is
+   claimed under cache_lock but compiled outside it; until its text is
+   set under the lock again, cache_find skips it. */
+static struct cached_program *cache_get(unsigned long long hash, char *text, long length) {
+  struct cached_program *p, *victim = NULL;
+  char *old_text;
+  void *old_tables;
+  int i, ok;
+
+  pthread_mutex_lock(&cache_lock);
+  p = cache_find(hash, text, length);
+  if(p != NULL) {
+    p->users++;
+    p->last_used = ++cache_clock;
+    pthread_mutex_unlock(&cache_lock);
+    free(text);
+    return p;
+  }
+  for(i = 0; i < CACHE_SIZE; i++) {
+    if(cache[i].users == 0 &&
+       (victim == NULL || cache[i].text == NULL ||
+        (victim->text != NULL && cache[i].last_used < victim->last_used))) {
+      victim = &cache[i];
+    }
+  }
+  if(victim == NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    free(text);
+    return NULL;
+  }
+  p = victim;
+  p->users = 1;
+  old_text = p->text;
+  old_tables = p->tables;
+  p->text = NULL;
+  p->tables = NULL;
+  pthread_mutex_unlock(&cache_lock);
+
+  free(old_text);
+  free(old_tables);
+  ubasic_measure(text, &p->layout);
+  p->tables = malloc(p->layout.table_bytes > 0 ? p->layout.table_bytes : 1);
+  ok = p->tables != NULL;
+  if(ok) {
+    memset(&p->template, 0, sizeof(p->template));
+    ubasic_select(&p->template);
+    ok = ubasic_init_mem(text, &p->layout, p->tables, p->layout.table_bytes) &&
+      ubasic_preload();
+    ubasic_select(NULL);
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  if(ok) {
+    /* Two connections sending the same new program may both compile it;
+       lookups then find the first copy and the other ages out */
+    p->hash = hash;
+    p->length = length;
+    p->text = text;
+    p->last_used = ++cache_clock;
+  } else {
+    p->users = 0;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  if(!ok) {
+    free(text);
+    return NULL;
+  }
+  return p;
+}
+
+/*---------------------------------------------------------------------------*/
+static struct cached_program *cache_get_by_hash(unsigned long long hash) {
+  struct cached_program *p;
+  pthread_mutex_lock(&cache_lock);
+  p = cache_find(hash, NULL, 0);
+  if(p != NULL) {
+    p->users++;
+    p->last_used = ++cache_clock;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return p;
+}
+
+/*---------------------------------------------------------------------------*/
+static void cache_release(struct cached_program *p) {
+  pthread_mutex_lock(&cache_lock);
+  p->users--;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*---------------------------------------------------------------------------*/
+static long elapsed_us(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000L +
+    (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/*---------------------------------------------------------------------------*/
+static void send_done(int fd, const char *status, long statements, long usec) {
+  char line[96];
+  snprintf(line, sizeof(line), "DONE %s %ld %ld\n", status, statements, usec);
+  write_all(fd, line, strlen(line));
+}
+
+/*---------------------------------------------------------------------------*/
+/* Steps the selected program until it ends, errors or hits a limit. Kept
+   apart from run_program so nothing it changes after setjmp lives in a
+   register that longjmp could clobber. */
+static const char *execute(long statement_limit, long time_limit_ms,
+                           const struct timespec *start, long *statements) {
+  if(setjmp(error_jump) != 0) return "error";
+  for(;;) {
+    if(ubasic_run() == UBASIC_RUN_END) return "ok";
+    /* Nothing can wake a program here, so WAIT and YIELD just continue */
+    if(++*statements >= statement_limit) return "statement-limit";
+    if(*statements % TIME_CHECK_INTERVAL == 0 &&
+       elapsed_us(start) / 1000 >= time_limit_ms) {
+      return "time-limit";
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+static void run_program(struct worker *w, struct cached_program *p,
+                        const VARIABLE_TYPE *vars, const char *set,
+                        long statement_limit, long time_limit_ms) {
+  VARIABLE_TYPE values[MAX_VARNUM];
+  struct ubasic_layout stacks;
+  unsigned long stacks_size;
+  struct timespec start;
+  const char *status;
+  long statements = 0;
+  long usec;
+  char line[16 + MAX_VARNUM * 12];
+  int i, n;
+
+  if(statement_limit <= 0) statement_limit = DEFAULT_STATEMENT_LIMIT;
+  if(time_limit_ms <= 0) time_limit_ms = DEFAULT_TIME_LIMIT_MS;
+
+  /* The worker shares the cached line index and brings its own stacks */
+  stacks = p->layout;
+  stacks.lines = 0;
+  stacks_size = p->layout.table_bytes - p->layout.line_index_bytes;
+  if(stacks_size > w->stacks_size) {
+    free(w->stacks);
+    w->stacks = malloc(stacks_size);
+    w->stacks_size = w->stacks != NULL ? stacks_size : 0;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  ubasic_select(&w->context);
+  if(!ubasic_init_mem(p->text, &stacks, w->stacks, w->stacks_size)) {
+    ubasic_select(NULL);
+    send_done(out_fd, "no-memory", 0, 0);
+    return;
+  }
+  ubasic_clone(&w->context, &p->template);
+  ubasic_set_string_arena(w->string_arena, sizeof(w->string_arena));
+  for(i = 0; i < MAX_VARNUM; i++) {
+    if(set[i]) ubasic_set_variable(i, vars[i]);
+  }
+
+  status = execute(statement_limit, time_limit_ms, &start, &statements);
+  usec = elapsed_us(&start);
+  out_flush();
+
+  if(strcmp(status, "error") == 0) {
+    n = snprintf(line, sizeof(line), "ERROR %s", error_message);
+    if(n > 0 && line[n - 1] != '\n') strcat(line, "\n");
+    write_all(out_fd, line, strlen(line));
+  }
+  snprintf(line, sizeof(line), "HASH %016llx\n", p->hash);
+  write_all(out_fd, line, strlen(line));
+
+  ubasic_get_variables(values, 0, MAX_VARNUM);
+  ubasic_select(NULL);
+  n = snprintf(line, sizeof(line), "VARS");
+  for(i = 0; i < MAX_VARNUM; i++) {
+    n += snprintf(line + n, sizeof(line) - n, " %d", values[i]);
+  }
+  line[n++] = '\n';
+  write_all(out_fd, line, n);
+  send_done(out_fd, status, statements, usec);
+}
+
+/*---------------------------------------------------------------------------*/
+static void serve_connection(struct worker *w, int fd) {
+  struct reader r;
+  struct cached_program *p;
+  VARIABLE_TYPE vars[MAX_VARNUM];
+  char set[MAX_VARNUM];
+  char line[256], name;
+  long statement_limit, time_limit_ms, length, value;
+  unsigned long long hash;
+  char *text;
+
+  r.fd = fd;
+  r.pos = r.len = 0;
+  out_fd = fd;
+  out_len = 0;
+  memset(set, 0, sizeof(set));
+
+  while(read_line(&r, line, sizeof(line)) >= 0) {
+    if(sscanf(line, "SET %c %ld", &name, &value) == 2 &&
+       name >= 'a' && name <= 'z') {
+      vars[name - 'a'] = value;
+      set[name - 'a'] = 1;
+      continue;
+    }
+    if(sscanf(line, "RUN %ld %ld %ld", &statement_limit, &time_limit_ms, &length) == 3) {
+      if(length < 0 || length > MAX_PROGRAM_SIZE) {
+        send_done(fd, "bad-request", 0, 0);
+        break;
+      }
+      text = malloc(length + 1);
+      if(text == NULL || read_exact(&r, text, length) < 0) {
+        free(text);
+        break;
+      }
+      text[length] = 0;
+      p = cache_get(hash_text(text, length), text, length);
+    } else if(sscanf(line, "EXEC %llx %ld %ld", &hash, &statement_limit, &time_limit_ms) == 3) {
+      p = cache_get_by_hash(hash);
+    } else {
+      send_done(fd, "bad-request", 0, 0);
+      break;
+    }
+
+    if(p == NULL) {
+      send_done(fd, "no-program", 0, 0);
+    } else {
+      run_program(w, p, vars, set, statement_limit, time_limit_ms);
+      cache_release(p);
+    }
+    memset(set, 0, sizeof(set));
+  }
+  close(fd);
+}
+
+/*---------------------------------------------------------------------------*/
+static void *worker_main(void *arg) {
+  struct worker *w = arg;
+  int fd;
+  for(;;) {
+    pthread_mutex_lock(&queue_lock);
+    while(connections_count == 0) pthread_cond_wait(&queue_cond, &queue_lock);
+    fd = connections[connections_head];
+    connections_head = (connections_head + 1) % CONNECTION_QUEUE;
+    connections_count--;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    serve_connection(w, fd);
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+int
+main(int argc, char *argv[])
+{
+  const char *path = DEFAULT_SOCKET;
+  struct sockaddr_un addr;
+  struct worker *workers;
+  int nworkers = DEFAULT_WORKERS;
+  int listen_fd, fd, opt, i;
+
+  while((opt = getopt(argc, argv, "s:w:")) != -1) {
+    switch(opt) {
+    case 's': path = optarg; break;
+    case 'w': nworkers = atoi(optarg); break;
+    default:
+      fprintf(stderr, "usage: ubasic-server [-s socket] [-w workers]\n");
+      return 2;
+    }
+  }
+  if(nworkers < 1) nworkers = 1;
+  if(nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+
+  signal(SIGPIPE, SIG_IGN);
+  ubasic_set_print_function(print_output);
+  ubasic_set_error_function(program_error);
+
+  listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(listen_fd < 0) {
+    perror("socket");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "%s: socket path too long\n", path);
+    return 1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if(bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+     listen(listen_fd, CONNECTION_QUEUE) < 0) {
+    perror(path);
+    return 1;
+  }
+
+  workers = calloc(nworkers, sizeof(*workers));
+  if(workers == NULL) {
+    perror("calloc");
+    return 1;
+  }
+  for(i = 0; i < nworkers; i++) {
+    if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+  fprintf(stderr, "ubasic-server: listening on %s with %d workers\n", path, nworkers);
+
+  for(;;) {
+    fd = accept(listen_fd, NULL, NULL);
+    if(fd < 0) {
+      if(errno == EINTR) continue;
+      perror("accept");
+      continue;
+    }
+    pthread_mutex_lock(&queue_lock);
+    while(connections_count == CONNECTION_QUEUE) pthread_cond_wait(&queue_cond, &queue_lock);
+    connections[(connections_head + connections_count) % CONNECTION_QUEUE] = fd;
+    connections_count++;
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+  }
+  return 0;
+}
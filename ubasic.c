@@ -30,7 +30,9 @@
 
 #include "ubasic.h"
 #include "tokenizer.h"
+#include <setjmp.h>
 #include <string.h>
+#include <stdatomic.h>
 
 /* Redirections for Circle / Bare Metal */
 extern void circle_basic_print(const char *s);
@@ -42,6 +44,26 @@ void ubasic_set_poke_function(void (*f)(VARIABLE_TYPE, VARIABLE_TYPE)) {
   poke_ptr = f;
 }
 
+static print_func print_function = (void*)0;
+
+void ubasic_set_print_function(print_func f) {
+  print_function = f;
+}
+
+static parallel_func parallel_function = (void*)0;
+
+void ubasic_set_parallel_function(parallel_func f) {
+  parallel_function = f;
+}
+
+struct ubasic_parallel_job {
+  const struct ubasic_context *parent;
+  int for_variable;
+  char const *body;
+  char const *body_end;
+  _Atomic(const char *) error; /* First error raised by a chunk */
+};
+
 #define DEBUG 0
 #if DEBUG
 #define DEBUG_PRINTF(...) 
@@ -51,36 +73,72 @@ void ubasic_set_poke_function(void (*f)(VARIABLE_TYPE, VARIABLE_TYPE)) {
 
 #define HALT() while(1)
 
-static char const *program_ptr;
-#define MAX_STRINGLEN 40
-static char string[MAX_STRINGLEN];
+static error_func error_function = (void*)0;
 
-#define MAX_GOSUB_STACK_DEPTH 10
-static int gosub_stack[MAX_GOSUB_STACK_DEPTH];
-static int gosub_stack_ptr;
+void ubasic_set_error_function(error_func f) {
+  error_function = f;
+}
 
-struct for_state {
-  int line_after_for;
-  int for_variable;
-  int to;
-};
-#define MAX_FOR_STACK_DEPTH 4
-static struct for_state for_stack[MAX_FOR_STACK_DEPTH];
-static int for_stack_ptr;
-
-/* Fixed-size index table instead of malloc'd linked list */
-struct line_index {
-  int line_number;
-  char const *program_text_position;
-};
-#define MAX_LINE_INDEXES 256
-static struct line_index line_index_table[MAX_LINE_INDEXES];
-static int line_index_current_ptr = 0;
+/* Set while this thread runs a PARALLEL FOR chunk, whose errors belong to
+   the thread that started the loop */
+static UBASIC_THREAD_LOCAL jmp_buf *chunk_jump = (void*)0;
+static UBASIC_THREAD_LOCAL const char *chunk_error;
 
-#define MAX_VARNUM 26
-static VARIABLE_TYPE variables[MAX_VARNUM];
+/* Reports a fatal error. The host's error function may longjmp() out of
+   the interpreter; if it returns, or there is none, execution stops. */
+static void basic_error(const char *message) {
+  if(chunk_jump != (void*)0) {
+    chunk_error = message;
+    longjmp(*chunk_jump, 1);
+  }
+  if(error_function != (void*)0) error_function(message);
+  circle_basic_print(message);
+  HALT();
+}
 
-static int ended;
+#if UBASIC_TRACE
+/* Each line fills its record with one store and keeps a pointer to it for
+   the jump target and variable written later in the line */
+#define TRACE_LINE(l, t) do { \
+    struct ubasic_trace_record *r = &ctx->trace[ctx->trace_head++ & (UBASIC_TRACE_RECORDS - 1)]; \
+    *r = (struct ubasic_trace_record){ (l), -1, 0, (t), 0xff, 0 }; \
+    ctx->trace_record = r; \
+  } while(0)
+#define TRACE_JUMP(l) (ctx->trace_record->target = (l))
+#define TRACE_SET(v, x) do { \
+    struct ubasic_trace_record *r = ctx->trace_record; \
+    r->variable = (v); r->value = (x); \
+  } while(0)
+#else
+#define TRACE_LINE(l, t)
+#define TRACE_JUMP(l)
+#define TRACE_SET(v, x)
+#endif
+
+#if UBASIC_STATS
+/* Only this thread writes the counters, so a relaxed load and store is
+   enough and needs no locked instruction */
+static void stats_inc(atomic_ulong *counter) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + 1,
+                        memory_order_relaxed);
+}
+static void stats_max(atomic_int *counter, int value) {
+  if(value > atomic_load_explicit(counter, memory_order_relaxed)) {
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+  }
+}
+#define STATS_INC(f) stats_inc(&ctx->stats.f)
+#define STATS_MAX(f, v) stats_max(&ctx->stats.f, (v))
+#else
+#define STATS_INC(f)
+#define STATS_MAX(f, v)
+#endif
+
+#define MAX_STRINGLEN 40
+static UBASIC_THREAD_LOCAL char string[MAX_STRINGLEN];
+
+static struct ubasic_context default_context;
+static UBASIC_THREAD_LOCAL struct ubasic_context *ctx = &default_context;
 
 static VARIABLE_TYPE expr(void);
 static void line_statement(void);
@@ -89,247 +147,762 @@ static void statement(void);
 peek_func peek_function = (void*)0;
 poke_func poke_function = (void*)0;
 
+/*---------------------------------------------------------------------------*/
+void ubasic_select(struct ubasic_context *context) {
+  ctx = context != (void*)0 ? context : &default_context;
+  tokenizer_set_state(&ctx->tokenizer);
+}
+/*---------------------------------------------------------------------------*/
+struct ubasic_context *ubasic_current(void) {
+  return ctx;
+}
+/*---------------------------------------------------------------------------*/
+/* Points the tables of a context that was never given any at its default
+   storage */
+static void default_tables(struct ubasic_context *c) {
+#if UBASIC_DEFAULT_TABLES
+  if(c->gosub_stack == (void*)0) {
+    c->gosub_stack = c->gosub_stack_storage;
+    c->gosub_stack_size = MAX_GOSUB_STACK_DEPTH;
+  }
+  if(c->for_stack == (void*)0) {
+    c->for_stack = c->for_stack_storage;
+    c->for_stack_size = MAX_FOR_STACK_DEPTH;
+  }
+  if(c->line_index_table == (void*)0) {
+    c->line_index_table = c->line_index_storage;
+    c->line_index_size = MAX_LINE_INDEXES;
+  }
+  if(c->if_skips == (void*)0) {
+    c->if_skips = c->if_skips_storage;
+    c->if_skips_size = MAX_IF_SKIPS;
+  }
+#else
+  (void)c;
+#endif
+}
 /*---------------------------------------------------------------------------*/
 void ubasic_init(const char *program) {
-  program_ptr = program;
-  for_stack_ptr = gosub_stack_ptr = 0;
-  line_index_current_ptr = 0; // Reset static index
+  tokenizer_set_state(&ctx->tokenizer);
+  if(ctx->variables == (void*)0) ctx->variables = ctx->variable_storage;
+  default_tables(ctx);
+  ctx->program_ptr = program;
+  ctx->for_stack_ptr = ctx->gosub_stack_ptr = 0;
+  ctx->line_index_current_ptr = 0; // Reset static index
+  ctx->line_slot = 0;
+  if(ctx->if_skips_size > 0) memset(ctx->if_skips, 0, ctx->if_skips_size * sizeof(*ctx->if_skips));
+  ctx->event_handlers_ptr = 0;
+  atomic_store(&ctx->event_head, 0);
+  atomic_store(&ctx->event_tail, 0);
   tokenizer_init(program);
-  ended = 0;
+  ctx->ended = 0;
+  ctx->suspend = UBASIC_RUN_OK;
+  memset(ctx->strings, 0, sizeof(ctx->strings));
+  ctx->string_arena_used = 0;
+#if UBASIC_STATS
+  memset(&ctx->stats, 0, sizeof(ctx->stats));
+#endif
+#if UBASIC_TRACE
+  ctx->trace_head = 0;
+  ctx->trace_record = &ctx->trace[0];
+#endif
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_clone(struct ubasic_context *dest, const struct ubasic_context *src) {
+  int *gosub_stack;
+  struct ubasic_for_state *for_stack;
+  struct ubasic_if_skip *if_skips;
+  int gosub_stack_size, for_stack_size, if_skips_size, fits;
+
+  default_tables(dest);
+  gosub_stack = dest->gosub_stack;
+  gosub_stack_size = dest->gosub_stack_size;
+  for_stack = dest->for_stack;
+  for_stack_size = dest->for_stack_size;
+  if_skips = dest->if_skips;
+  if_skips_size = dest->if_skips_size;
+
+  memcpy(dest, src, sizeof(*dest));
+  /* src's variables may be bound to host memory; the clone gets its own */
+  memcpy(dest->variable_storage, src->variables != (void*)0 ? src->variables : src->variable_storage,
+         sizeof(dest->variable_storage));
+  dest->variables = dest->variable_storage;
+#if UBASIC_TRACE
+  dest->trace_record = &dest->trace[src->trace_record - src->trace];
+#endif
+#if UBASIC_DEFAULT_TABLES
+  if(src->line_index_table == src->line_index_storage) {
+    dest->line_index_table = dest->line_index_storage;
+  } else
+#endif
+  /* A shared index is read-only: lines src has not indexed are found by
+     rescanning, never added */
+  dest->line_index_size = src->line_index_current_ptr;
+
+  /* Stacks and the IF cache are written while running, so dest keeps its
+     own; frames that do not fit are dropped */
+  dest->gosub_stack = gosub_stack;
+  dest->gosub_stack_size = gosub_stack_size;
+  dest->for_stack = for_stack;
+  dest->for_stack_size = for_stack_size;
+  dest->if_skips = if_skips;
+  dest->if_skips_size = if_skips_size;
+  fits = src->gosub_stack_ptr <= gosub_stack_size && src->for_stack_ptr <= for_stack_size;
+  if(dest->gosub_stack_ptr > gosub_stack_size) dest->gosub_stack_ptr = gosub_stack_size;
+  if(dest->for_stack_ptr > for_stack_size) dest->for_stack_ptr = for_stack_size;
+  if(dest->gosub_stack_ptr > 0) {
+    memcpy(gosub_stack, src->gosub_stack, dest->gosub_stack_ptr * sizeof(*gosub_stack));
+  }
+  if(dest->for_stack_ptr > 0) {
+    memcpy(for_stack, src->for_stack, dest->for_stack_ptr * sizeof(*for_stack));
+  }
+  if(if_skips_size > 0) {
+    if(if_skips_size == src->if_skips_size) {
+      memcpy(if_skips, src->if_skips, if_skips_size * sizeof(*if_skips));
+    } else memset(if_skips, 0, if_skips_size * sizeof(*if_skips));
+  }
+  return fits;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_set_line_index(struct ubasic_line_index *table, int size) {
+  if(table == (void*)0 || size <= 0) {
+#if UBASIC_DEFAULT_TABLES
+    table = ctx->line_index_storage;
+    size = MAX_LINE_INDEXES;
+#else
+    table = (void*)0;
+    size = 0;
+#endif
+  }
+  ctx->line_index_table = table;
+  ctx->line_index_size = size;
+  ctx->line_index_current_ptr = 0;
 }
 /*---------------------------------------------------------------------------*/
 void ubasic_init_peek_poke(const char *program, peek_func peek, poke_func poke) {
-  program_ptr = program;
-  for_stack_ptr = gosub_stack_ptr = 0;
-  line_index_current_ptr = 0;
   peek_function = peek;
   poke_function = poke;
-  tokenizer_init(program);
-  ended = 0;
+  ubasic_init(program);
 }
 /*---------------------------------------------------------------------------*/
 static void accept(int token) {
   if(token != tokenizer_token()) {
-    circle_basic_print("Unexpected token error\n");
-    HALT();
+    basic_error("Unexpected token error\n");
   }
   tokenizer_next();
 }
 /*---------------------------------------------------------------------------*/
-static int varfactor(void) {
-  int r = ubasic_get_variable(tokenizer_variable_num());
-  accept(TOKENIZER_VARIABLE);
-  return r;
+static int number(void) {
+  if(tokenizer_num_overflow()) {
+    basic_error("Number overflow error\n");
+  }
+  return tokenizer_num();
 }
 /*---------------------------------------------------------------------------*/
-static int factor(void) {
-  int r;
-  switch(tokenizer_token()) {
-  case TOKENIZER_NUMBER:
-    r = tokenizer_num();
-    accept(TOKENIZER_NUMBER);
-    break;
-  case TOKENIZER_LEFTPAREN:
-    accept(TOKENIZER_LEFTPAREN);
-    r = expr();
-    accept(TOKENIZER_RIGHTPAREN);
-    break;
-  default:
-    r = varfactor();
-    break;
-  }
-  return r;
+/* Expressions are evaluated by precedence climbing over two small explicit
+   stacks instead of one recursive call per grammar level. Operators, from
+   loosest to tightest binding:
+
+     or
+     and
+     not
+     =  <>  <  >  <=  >=
+     +  -  &  |
+     *  /  %
+     unary -
+
+   "and" and "or" short-circuit: the right operand is skipped, not
+   evaluated, once the result is known. */
+#define MAX_EXPR_DEPTH 16
+
+enum {
+  OP_NEGATE = TOKENIZER_NUM_TOKENS,
+  OP_PAREN,
+};
+
+/* Binding power of each operator; 0 for tokens that end an expression */
+static const unsigned char precedence[OP_PAREN + 1] = {
+  [TOKENIZER_LOGOR]  = 1,
+  [TOKENIZER_LOGAND] = 2,
+  [TOKENIZER_NOT]    = 3,
+  [TOKENIZER_LT]     = 4,
+  [TOKENIZER_GT]     = 4,
+  [TOKENIZER_EQ]     = 4,
+  [TOKENIZER_LE]     = 4,
+  [TOKENIZER_GE]     = 4,
+  [TOKENIZER_NE]     = 4,
+  [TOKENIZER_PLUS]   = 5,
+  [TOKENIZER_MINUS]  = 5,
+  [TOKENIZER_AND]    = 5,
+  [TOKENIZER_OR]     = 5,
+  [TOKENIZER_ASTR]   = 6,
+  [TOKENIZER_SLASH]  = 6,
+  [TOKENIZER_MOD]    = 6,
+  [OP_NEGATE]        = 7,
+};
+/*---------------------------------------------------------------------------*/
+static void expr_error(void) {
+  basic_error("Expression error\n");
 }
 /*---------------------------------------------------------------------------*/
-static int term(void) {
-  int f1, f2, op;
-  f1 = factor();
-  op = tokenizer_token();
-  while(op == TOKENIZER_ASTR || op == TOKENIZER_SLASH || op == TOKENIZER_MOD) {
-    tokenizer_next();
-    f2 = factor();
-    if (op == TOKENIZER_ASTR) f1 = f1 * f2;
-    else if (op == TOKENIZER_SLASH) f1 = f1 / f2;
-    else if (op == TOKENIZER_MOD) f1 = f1 % f2;
-    op = tokenizer_token();
+static int apply(int op, int a, int b) {
+  switch(op) {
+  case TOKENIZER_LOGOR:  return a || b;
+  case TOKENIZER_LOGAND: return a && b;
+  case TOKENIZER_LT:     return a < b;
+  case TOKENIZER_GT:     return a > b;
+  case TOKENIZER_EQ:     return a == b;
+  case TOKENIZER_LE:     return a <= b;
+  case TOKENIZER_GE:     return a >= b;
+  case TOKENIZER_NE:     return a != b;
+  case TOKENIZER_PLUS:   return a + b;
+  case TOKENIZER_MINUS:  return a - b;
+  case TOKENIZER_AND:    return a & b;
+  case TOKENIZER_OR:     return a | b;
+  case TOKENIZER_ASTR:   return a * b;
+  case TOKENIZER_SLASH:  return a / b;
+  case TOKENIZER_MOD:    return a % b;
+  default:               return 0;
   }
-  return f1;
 }
 /*---------------------------------------------------------------------------*/
-static VARIABLE_TYPE expr(void) {
-  int t1, t2, op;
-  t1 = term();
-  op = tokenizer_token();
-  while(op == TOKENIZER_PLUS || op == TOKENIZER_MINUS || op == TOKENIZER_AND || op == TOKENIZER_OR) {
+/* Skips the right operand of a short-circuited operator of precedence
+   prec: everything up to the next operator binding no tighter, or the end
+   of the expression. */
+static void skip_operand(int prec) {
+  int depth = 0, token, p;
+  for(;;) {
+    token = tokenizer_token();
+    p = precedence[token];
+    if(token == TOKENIZER_LEFTPAREN) depth++;
+    else if(token == TOKENIZER_RIGHTPAREN) {
+      if(depth == 0) return;
+      depth--;
+    } else if(depth == 0 && p > 0 && p <= prec && token != TOKENIZER_NOT) return;
+    else if(p == 0 && token != TOKENIZER_NUMBER && token != TOKENIZER_VARIABLE) {
+      if(depth > 0) expr_error();
+      return;
+    }
     tokenizer_next();
-    t2 = term();
-    if (op == TOKENIZER_PLUS) t1 = t1 + t2;
-    else if (op == TOKENIZER_MINUS) t1 = t1 - t2;
-    else if (op == TOKENIZER_AND) t1 = t1 & t2;
-    else if (op == TOKENIZER_OR) t1 = t1 | t2;
-    op = tokenizer_token();
   }
-  return t1;
 }
 /*---------------------------------------------------------------------------*/
-static int relation(void) {
-  int r1, r2, op;
-  r1 = expr();
-  op = tokenizer_token();
-  while(op == TOKENIZER_LT || op == TOKENIZER_GT || op == TOKENIZER_EQ) {
+/* Full int result, for values that are not stored in a variable */
+static int expr_int(void) {
+  int values[MAX_EXPR_DEPTH], ops[MAX_EXPR_DEPTH];
+  int nvalues = 0, nops = 0, token, prec, op;
+
+  for(;;) {
+    /* Operand: any number of prefix operators and parentheses, then a
+       number or a variable */
+    token = tokenizer_token();
+    if(token == TOKENIZER_MINUS || token == TOKENIZER_NOT || token == TOKENIZER_LEFTPAREN) {
+      if(nops == MAX_EXPR_DEPTH) expr_error();
+      ops[nops++] = token == TOKENIZER_MINUS ? OP_NEGATE :
+                    token == TOKENIZER_NOT ? TOKENIZER_NOT : OP_PAREN;
+      tokenizer_next();
+      continue;
+    }
+    if(nvalues == MAX_EXPR_DEPTH) expr_error();
+    if(token == TOKENIZER_NUMBER) values[nvalues++] = number();
+    else if(token == TOKENIZER_VARIABLE) values[nvalues++] = ctx->variables[tokenizer_variable_num()];
+    else expr_error();
     tokenizer_next();
-    r2 = expr();
-    if (op == TOKENIZER_LT) r1 = r1 < r2;
-    else if (op == TOKENIZER_GT) r1 = r1 > r2;
-    else if (op == TOKENIZER_EQ) r1 = r1 == r2;
-    op = tokenizer_token();
+
+    /* Operator: reduce everything on the stack that binds at least as
+       tightly, then either push it or finish */
+    for(;;) {
+      token = tokenizer_token();
+      prec = token == TOKENIZER_RIGHTPAREN ? -1 : precedence[token];
+      while(nops > 0 && ops[nops - 1] != OP_PAREN &&
+            (prec <= 0 || precedence[ops[nops - 1]] >= prec)) {
+        op = ops[--nops];
+        if(op == OP_NEGATE) values[nvalues - 1] = -values[nvalues - 1];
+        else if(op == TOKENIZER_NOT) values[nvalues - 1] = !values[nvalues - 1];
+        else {
+          nvalues--;
+          values[nvalues - 1] = apply(op, values[nvalues - 1], values[nvalues]);
+        }
+      }
+      if(prec == -1 && nops > 0) {
+        /* Closes a parenthesis opened in this expression */
+        nops--;
+        tokenizer_next();
+        continue;
+      }
+      if(prec <= 0) {
+        if(nops > 0) expr_error();
+        return values[0];
+      }
+      tokenizer_next();
+      if((token == TOKENIZER_LOGAND && !values[nvalues - 1]) ||
+         (token == TOKENIZER_LOGOR && values[nvalues - 1])) {
+        values[nvalues - 1] = token == TOKENIZER_LOGOR;
+        skip_operand(prec);
+        continue;
+      }
+      if(nops == MAX_EXPR_DEPTH) expr_error();
+      ops[nops++] = token;
+      break;
+    }
   }
-  return r1;
+}
+/*---------------------------------------------------------------------------*/
+static VARIABLE_TYPE expr(void) {
+  return expr_int();
 }
 /*---------------------------------------------------------------------------*/
 static void index_free(void) {
-    line_index_current_ptr = 0;
+    ctx->line_index_current_ptr = 0;
 }
 /*---------------------------------------------------------------------------*/
-static char const* index_find(int linenum) {
-  for(int i = 0; i < line_index_current_ptr; i++) {
-    if(line_index_table[i].line_number == linenum) {
-      return line_index_table[i].program_text_position;
-    }
+/* Position of the first entry not below linenum */
+static int index_search(int linenum) {
+  int lo = 0, hi = ctx->line_index_current_ptr, mid;
+  while(lo < hi) {
+    mid = (lo + hi) / 2;
+    if(ctx->line_index_table[mid].line_number < linenum) lo = mid + 1;
+    else hi = mid;
   }
-  return (void*)0;
+  return lo;
 }
 /*---------------------------------------------------------------------------*/
-static void index_add(int linenum, char const* sourcepos) {
-  if(index_find(linenum)) return;
-  if(line_index_current_ptr < MAX_LINE_INDEXES) {
-    line_index_table[line_index_current_ptr].line_number = linenum;
-    line_index_table[line_index_current_ptr].program_text_position = sourcepos;
-    line_index_current_ptr++;
-  }
+/* Returns the slot of linenum's entry, adding it if needed, or -1 if the
+   index is full */
+static int index_add(int linenum, char const* sourcepos) {
+  struct ubasic_line_index *table = ctx->line_index_table;
+  int n = ctx->line_index_current_ptr, i;
+  /* Lines are usually added in ascending order, so check the end first */
+  i = n > 0 && table[n - 1].line_number >= linenum ? index_search(linenum) : n;
+  if(i < n && table[i].line_number == linenum) return i;
+  if(n == ctx->line_index_size) return -1;
+  memmove(&table[i + 1], &table[i], (n - i) * sizeof(*table));
+  memset(&table[i], 0, sizeof(*table));
+  table[i].line_number = linenum;
+  table[i].program_text_position = sourcepos;
+  table[i].target_slot = -1;
+  ctx->line_index_current_ptr++;
+  return i;
 }
 /*---------------------------------------------------------------------------*/
 static void jump_linenum_slow(int linenum) {
-  tokenizer_init(program_ptr);
+  STATS_INC(slow_jumps);
+  tokenizer_init(ctx->program_ptr);
   while(tokenizer_num() != linenum) {
     do {
       do {
         tokenizer_next();
       } while(tokenizer_token() != TOKENIZER_CR && tokenizer_token() != TOKENIZER_ENDOFINPUT);
       if(tokenizer_token() == TOKENIZER_CR) tokenizer_next();
+      if(tokenizer_token() == TOKENIZER_ENDOFINPUT) {
+        basic_error("Line not found error\n");
+        return;
+      }
     } while(tokenizer_token() != TOKENIZER_NUMBER);
   }
 }
 /*---------------------------------------------------------------------------*/
+static void jump_slot(int slot) {
+  struct ubasic_line_index *line = &ctx->line_index_table[slot];
+  TRACE_JUMP(line->line_number);
+  STATS_INC(jumps);
+  STATS_INC(index_hits);
+  ctx->line_slot = slot;
+  tokenizer_goto(line->program_text_position);
+}
+/*---------------------------------------------------------------------------*/
 static void jump_linenum(int linenum) {
-  char const* pos = index_find(linenum);
-  if(pos != (void*)0) tokenizer_goto(pos);
-  else jump_linenum_slow(linenum);
+  int i = index_search(linenum);
+  if(i < ctx->line_index_current_ptr && ctx->line_index_table[i].line_number == linenum) {
+    jump_slot(i);
+    return;
+  }
+  TRACE_JUMP(linenum);
+  STATS_INC(jumps);
+  STATS_INC(index_misses);
+  jump_linenum_slow(linenum);
+}
+/*---------------------------------------------------------------------------*/
+/* Jumps through a remembered slot, which lines added to the index since
+   may have moved */
+static void jump_line_slot(int linenum, int slot) {
+  if(slot >= 0 && slot < ctx->line_index_current_ptr &&
+     ctx->line_index_table[slot].line_number == linenum) {
+    jump_slot(slot);
+  } else jump_linenum(linenum);
 }
 /*---------------------------------------------------------------------------*/
 static void goto_statement(void) {
   accept(TOKENIZER_GOTO);
-  jump_linenum(tokenizer_num());
+  jump_linenum(number());
+}
+/*---------------------------------------------------------------------------*/
+static void print_slice(char const *s, int len) {
+  int n;
+  if(len <= 0) return;
+  STATS_INC(print_calls);
+  if(print_function != (void*)0) {
+    print_function(s, len);
+    return;
+  }
+  while(len > 0) {
+    n = len < MAX_STRINGLEN - 1 ? len : MAX_STRINGLEN - 1;
+    memcpy(string, s, n);
+    string[n] = 0;
+    circle_basic_print(string);
+    s += n;
+    len -= n;
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void print_number(int n) {
+  char buf[12];
+  unsigned int u = n < 0 ? 0u - (unsigned int)n : (unsigned int)n;
+  int i = sizeof(buf);
+  if(print_function == (void*)0) {
+    STATS_INC(print_calls);
+    circle_basic_print_num(n);
+    return;
+  }
+  do {
+    buf[--i] = '0' + u % 10;
+    u /= 10;
+  } while(u > 0);
+  if(n < 0) buf[--i] = '-';
+  print_slice(buf + i, sizeof(buf) - i);
 }
 /*---------------------------------------------------------------------------*/
 static void print_statement(void) {
+  char const *s;
+  int len;
   accept(TOKENIZER_PRINT);
   do {
     if(tokenizer_token() == TOKENIZER_STRING) {
-      tokenizer_string(string, sizeof(string));
-      circle_basic_print(string);
+      s = tokenizer_string_slice(&len);
+      print_slice(s, len);
+      tokenizer_next();
+    } else if(tokenizer_token() == TOKENIZER_STRINGVARIABLE) {
+      s = ubasic_get_string_variable(tokenizer_variable_num(), &len);
+      print_slice(s, len);
       tokenizer_next();
     } else if(tokenizer_token() == TOKENIZER_COMMA) {
-      circle_basic_print(" ");
+      print_slice(" ", 1);
       tokenizer_next();
     } else if(tokenizer_token() == TOKENIZER_SEMICOLON) {
       tokenizer_next();
-    } else if(tokenizer_token() == TOKENIZER_VARIABLE || tokenizer_token() == TOKENIZER_NUMBER) {
-      circle_basic_print_num(expr());
+    } else if(tokenizer_token() == TOKENIZER_VARIABLE || tokenizer_token() == TOKENIZER_NUMBER ||
+              tokenizer_token() == TOKENIZER_MINUS || tokenizer_token() == TOKENIZER_NOT ||
+              tokenizer_token() == TOKENIZER_LEFTPAREN) {
+      print_number(expr());
     } else break;
   } while(tokenizer_token() != TOKENIZER_CR && tokenizer_token() != TOKENIZER_ENDOFINPUT);
-  circle_basic_print("\n");
+  print_slice("\n", 1);
   tokenizer_next();
 }
 /*---------------------------------------------------------------------------*/
 static void if_statement(void) {
+  struct ubasic_if_skip *skip, uncached = {(void*)0, (void*)0, 0};
+  char const *if_pos = tokenizer_pos();
   int r;
   accept(TOKENIZER_IF);
-  r = relation();
+  r = expr();
   accept(TOKENIZER_THEN);
-  if(r) statement();
-  else {
+  if(r) {
+    statement();
+    return;
+  }
+
+  /* The first false condition at each IF scans to ELSE or the end of the
+     line once; later ones jump straight there */
+  skip = ctx->if_skips_size > 0 ?
+    &ctx->if_skips[((unsigned long)if_pos >> 2) & (ctx->if_skips_size - 1)] : &uncached;
+  if(skip->if_pos == if_pos) {
+    tokenizer_goto(skip->target);
+  } else {
     do {
       tokenizer_next();
     } while(tokenizer_token() != TOKENIZER_ELSE && tokenizer_token() != TOKENIZER_CR && tokenizer_token() != TOKENIZER_ENDOFINPUT);
-    if(tokenizer_token() == TOKENIZER_ELSE) {
-      tokenizer_next();
-      statement();
-    } else if(tokenizer_token() == TOKENIZER_CR) tokenizer_next();
+    skip->has_else = tokenizer_token() == TOKENIZER_ELSE;
+    if(tokenizer_token() != TOKENIZER_ENDOFINPUT) tokenizer_next();
+    skip->if_pos = if_pos;
+    skip->target = tokenizer_pos();
   }
+  if(skip->has_else) statement();
+}
+/*---------------------------------------------------------------------------*/
+static void string_operand(struct ubasic_string *r) {
+  if(tokenizer_token() == TOKENIZER_STRING) {
+    r->ptr = tokenizer_string_slice(&r->len);
+    accept(TOKENIZER_STRING);
+  } else {
+    int var = tokenizer_variable_num();
+    accept(TOKENIZER_STRINGVARIABLE);
+    *r = ctx->strings[var];
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void string_let_statement(void) {
+  struct ubasic_string r, operand;
+  char *start;
+  int var = tokenizer_variable_num();
+  accept(TOKENIZER_STRINGVARIABLE);
+  accept(TOKENIZER_EQ);
+  string_operand(&r);
+
+  /* Concatenations are appended to the arena; a single operand is shared */
+  if(tokenizer_token() == TOKENIZER_PLUS) {
+    start = ctx->string_arena + ctx->string_arena_used;
+    do {
+      if(ctx->string_arena_used + r.len > ctx->string_arena_size) {
+        basic_error("Out of string memory\n");
+      }
+      memcpy(ctx->string_arena + ctx->string_arena_used, r.ptr, r.len);
+      ctx->string_arena_used += r.len;
+      if(tokenizer_token() != TOKENIZER_PLUS) break;
+      accept(TOKENIZER_PLUS);
+      string_operand(&operand);
+      r = operand;
+    } while(1);
+    r.ptr = start;
+    r.len = ctx->string_arena + ctx->string_arena_used - start;
+  }
+  ctx->strings[var] = r;
+  accept(TOKENIZER_CR);
 }
 /*---------------------------------------------------------------------------*/
 static void let_statement(void) {
   int var = tokenizer_variable_num();
+  if(tokenizer_token() == TOKENIZER_STRINGVARIABLE) {
+    string_let_statement();
+    return;
+  }
   accept(TOKENIZER_VARIABLE);
   accept(TOKENIZER_EQ);
-  ubasic_set_variable(var, expr());
+  ctx->variables[var] = expr();
+  TRACE_SET(var, ctx->variables[var]);
   accept(TOKENIZER_CR);
 }
 /*---------------------------------------------------------------------------*/
+/* Saves the current line as the return address and jumps to linenum */
+static void gosub_jump(int linenum) {
+  if(ctx->gosub_stack_ptr >= ctx->gosub_stack_size) {
+    basic_error("GOSUB stack overflow error\n");
+    return;
+  }
+  ctx->gosub_stack[ctx->gosub_stack_ptr] = tokenizer_num();
+  ctx->gosub_stack_ptr++;
+  STATS_MAX(max_gosub_depth, ctx->gosub_stack_ptr);
+  jump_linenum(linenum);
+}
+/*---------------------------------------------------------------------------*/
 static void gosub_statement(void) {
   int linenum;
   accept(TOKENIZER_GOSUB);
-  linenum = tokenizer_num();
+  linenum = number();
   accept(TOKENIZER_NUMBER);
   accept(TOKENIZER_CR);
-  if(gosub_stack_ptr < MAX_GOSUB_STACK_DEPTH) {
-    gosub_stack[gosub_stack_ptr] = tokenizer_num();
-    gosub_stack_ptr++;
-    jump_linenum(linenum);
-  }
+  gosub_jump(linenum);
 }
 /*---------------------------------------------------------------------------*/
 static void return_statement(void) {
   accept(TOKENIZER_RETURN);
-  if(gosub_stack_ptr > 0) {
-    gosub_stack_ptr--;
-    jump_linenum(gosub_stack[gosub_stack_ptr]);
+  if(ctx->gosub_stack_ptr > 0) {
+    ctx->gosub_stack_ptr--;
+    jump_linenum(ctx->gosub_stack[ctx->gosub_stack_ptr]);
   }
 }
 /*---------------------------------------------------------------------------*/
+/* Steps the innermost FOR loop if var is its variable; returns 1 if it
+   jumped back to the top of the loop */
+static int for_next(int var) {
+  struct ubasic_for_state *f;
+  if(ctx->for_stack_ptr == 0) return 0;
+  f = &ctx->for_stack[ctx->for_stack_ptr - 1];
+  if(var != f->for_variable) return 0;
+  ctx->variables[var] += f->step;
+  TRACE_SET(var, ctx->variables[var]);
+  if(f->step >= 0 ? ctx->variables[var] <= f->to : ctx->variables[var] >= f->to) {
+    jump_line_slot(f->line_after_for, f->line_after_for_slot);
+    return 1;
+  }
+  ctx->for_stack_ptr--;
+  return 0;
+}
+/*---------------------------------------------------------------------------*/
 static void next_statement(void) {
   int var;
   accept(TOKENIZER_NEXT);
   var = tokenizer_variable_num();
   accept(TOKENIZER_VARIABLE);
-  if(for_stack_ptr > 0 && var == for_stack[for_stack_ptr - 1].for_variable) {
-    ubasic_set_variable(var, ubasic_get_variable(var) + 1);
-    if(ubasic_get_variable(var) <= for_stack[for_stack_ptr - 1].to) {
-      jump_linenum(for_stack[for_stack_ptr - 1].line_after_for);
-    } else {
-      for_stack_ptr--;
-      accept(TOKENIZER_CR);
+  if(!for_next(var)) accept(TOKENIZER_CR);
+}
+/*---------------------------------------------------------------------------*/
+static void for_push(int for_variable, int to, int step) {
+  int i;
+  /* A FOR on a variable that already has a frame restarts that loop and
+     drops the loops inside it, so jumping out of a loop and back into it
+     does not grow the stack */
+  for(i = ctx->for_stack_ptr - 1; i >= 0; i--) {
+    if(ctx->for_stack[i].for_variable == for_variable) {
+      ctx->for_stack_ptr = i;
+      break;
     }
-  } else accept(TOKENIZER_CR);
+  }
+  if(ctx->for_stack_ptr >= ctx->for_stack_size) {
+    basic_error("FOR stack overflow error\n");
+    return;
+  }
+  ctx->for_stack[ctx->for_stack_ptr].line_after_for = tokenizer_num();
+  ctx->for_stack[ctx->for_stack_ptr].line_after_for_slot = ctx->line_slot;
+  ctx->for_stack[ctx->for_stack_ptr].for_variable = for_variable;
+  ctx->for_stack[ctx->for_stack_ptr].to = to;
+  ctx->for_stack[ctx->for_stack_ptr].step = step;
+  ctx->for_stack_ptr++;
+  STATS_MAX(max_for_depth, ctx->for_stack_ptr);
 }
 /*---------------------------------------------------------------------------*/
 static void for_statement(void) {
-  int for_variable, to;
+  int for_variable, to, step = 1;
   accept(TOKENIZER_FOR);
   for_variable = tokenizer_variable_num();
   accept(TOKENIZER_VARIABLE);
   accept(TOKENIZER_EQ);
-  ubasic_set_variable(for_variable, expr());
+  ctx->variables[for_variable] = expr();
+  TRACE_SET(for_variable, ctx->variables[for_variable]);
   accept(TOKENIZER_TO);
   to = expr();
+  if(tokenizer_token() == TOKENIZER_STEP) {
+    accept(TOKENIZER_STEP);
+    step = expr();
+  }
   accept(TOKENIZER_CR);
-  if(for_stack_ptr < MAX_FOR_STACK_DEPTH) {
-    for_stack[for_stack_ptr].line_after_for = tokenizer_num();
-    for_stack[for_stack_ptr].for_variable = for_variable;
-    for_stack[for_stack_ptr].to = to;
-    for_stack_ptr++;
+  for_push(for_variable, to, step);
+}
+/*---------------------------------------------------------------------------*/
+static int skip_to_next_line(void) {
+  while(tokenizer_token() != TOKENIZER_CR) {
+    if(tokenizer_token() == TOKENIZER_ENDOFINPUT ||
+       tokenizer_token() == TOKENIZER_ERROR) return 0;
+    tokenizer_next();
   }
+  tokenizer_next();
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Scans a PARALLEL FOR body starting at the current line and returns the
+   position of its NEXT line. Iterations can only run independently if the
+   body writes nothing but host memory, so any line other than POKE or
+   IF ... THEN POKE [ELSE POKE] makes this return NULL. */
+static char const *parallel_body_end(int for_variable) {
+  char const *pos;
+  while(tokenizer_token() == TOKENIZER_NUMBER) {
+    pos = tokenizer_pos();
+    tokenizer_next();
+    switch(tokenizer_token()) {
+    case TOKENIZER_NEXT:
+      tokenizer_next();
+      if(tokenizer_token() == TOKENIZER_VARIABLE &&
+         tokenizer_variable_num() == for_variable) return pos;
+      return (void*)0;
+    case TOKENIZER_POKE:
+      break;
+    case TOKENIZER_IF:
+      while(tokenizer_token() != TOKENIZER_CR) {
+        if(tokenizer_token() == TOKENIZER_ENDOFINPUT ||
+           tokenizer_token() == TOKENIZER_ERROR) return (void*)0;
+        if(tokenizer_token() == TOKENIZER_THEN ||
+           tokenizer_token() == TOKENIZER_ELSE) {
+          tokenizer_next();
+          if(tokenizer_token() != TOKENIZER_POKE) return (void*)0;
+        }
+        tokenizer_next();
+      }
+      break;
+    default:
+      return (void*)0;
+    }
+    if(!skip_to_next_line()) return (void*)0;
+  }
+  return (void*)0;
+}
+/*---------------------------------------------------------------------------*/
+static void parallel_statement(void) {
+  struct ubasic_parallel_job job;
+  int for_variable, from, to;
+  accept(TOKENIZER_PARALLEL);
+  accept(TOKENIZER_FOR);
+  for_variable = tokenizer_variable_num();
+  accept(TOKENIZER_VARIABLE);
+  accept(TOKENIZER_EQ);
+  ctx->variables[for_variable] = expr();
+  from = ctx->variables[for_variable];
+  accept(TOKENIZER_TO);
+  to = expr();
+  accept(TOKENIZER_CR);
+
+  job.body = tokenizer_pos();
+  job.body_end = (void*)0;
+  if(parallel_function != (void*)0) job.body_end = parallel_body_end(for_variable);
+  tokenizer_goto(job.body);
+  if(job.body_end == (void*)0) {
+    for_push(for_variable, to, 1);
+    return;
+  }
+
+  /* Like FOR, the body runs at least once */
+  if(to < from) to = from;
+  job.parent = ctx;
+  job.for_variable = for_variable;
+  atomic_init(&job.error, (void*)0);
+  parallel_function(&job, from, to);
+  if(atomic_load(&job.error) != (void*)0) {
+    basic_error(atomic_load(&job.error));
+    return;
+  }
+  ctx->variables[for_variable] = to + 1;
+  TRACE_SET(for_variable, ctx->variables[for_variable]);
+
+  tokenizer_goto(job.body_end);
+  accept(TOKENIZER_NUMBER);
+  accept(TOKENIZER_NEXT);
+  accept(TOKENIZER_VARIABLE);
+  accept(TOKENIZER_CR);
+}
+/*---------------------------------------------------------------------------*/
+static void chunk_run(struct ubasic_parallel_job *job, int from, int to) {
+  int i;
+  for(i = from; i <= to; i++) {
+    /* Once one chunk has failed the rest of the loop is wasted work */
+    if(atomic_load_explicit(&job->error, memory_order_relaxed) != (void*)0) return;
+    ctx->variables[job->for_variable] = i;
+    tokenizer_goto(job->body);
+    while(tokenizer_pos() != job->body_end && !ubasic_finished()) {
+      line_statement();
+    }
+  }
+}
+/*---------------------------------------------------------------------------*/
+/* Errors in the chunk are caught here and handed back through the job, so
+   they are raised on the thread running the PARALLEL FOR, and the thread
+   running the chunk always returns to its caller */
+void ubasic_parallel_chunk(struct ubasic_parallel_job *job,
+                           struct ubasic_context *worker, int from, int to) {
+  struct ubasic_context *previous = ctx;
+  jmp_buf *outer = chunk_jump;
+  jmp_buf jump;
+  const char *expected = (void*)0;
+
+  ubasic_clone(worker, job->parent);
+  ubasic_select(worker);
+  ctx->for_stack_ptr = ctx->gosub_stack_ptr = 0;
+  if(setjmp(jump) == 0) {
+    chunk_jump = &jump;
+    chunk_run(job, from, to);
+  } else {
+    atomic_compare_exchange_strong(&job->error, &expected, chunk_error);
+  }
+  chunk_jump = outer;
+  ubasic_select(previous);
 }
 /*---------------------------------------------------------------------------*/
 static void peek_statement(void) {
@@ -341,7 +914,11 @@ static void peek_statement(void) {
   var = tokenizer_variable_num();
   accept(TOKENIZER_VARIABLE);
   accept(TOKENIZER_CR);
-  if(peek_function) ubasic_set_variable(var, peek_function(peek_addr));
+  if(peek_function) {
+    ctx->variables[var] = peek_function(peek_addr);
+    STATS_INC(peek_calls);
+    TRACE_SET(var, ctx->variables[var]);
+  }
 }
 /*---------------------------------------------------------------------------*/
 static void poke_statement(void) {
@@ -353,12 +930,53 @@ static void poke_statement(void) {
 
   if (poke_ptr != NULL) {
     poke_ptr(addr, val);
+    STATS_INC(poke_calls);
+  }
+}
+/*---------------------------------------------------------------------------*/
+static void on_statement(void) {
+  int event, linenum, i;
+  accept(TOKENIZER_ON);
+  accept(TOKENIZER_EVENT);
+  event = expr_int();
+  accept(TOKENIZER_GOSUB);
+  linenum = number();
+  accept(TOKENIZER_NUMBER);
+  accept(TOKENIZER_CR);
+  for(i = 0; i < ctx->event_handlers_ptr; i++) {
+    if(ctx->event_handlers[i].event == event) {
+      ctx->event_handlers[i].line_number = linenum;
+      return;
+    }
+  }
+  if(ctx->event_handlers_ptr >= MAX_EVENT_HANDLERS) {
+    basic_error("Too many event handlers error\n");
+    return;
   }
+  ctx->event_handlers[ctx->event_handlers_ptr].event = event;
+  ctx->event_handlers[ctx->event_handlers_ptr].line_number = linenum;
+  ctx->event_handlers_ptr++;
+}
+/*---------------------------------------------------------------------------*/
+static void yield_statement(void) {
+  accept(TOKENIZER_YIELD);
+  accept(TOKENIZER_CR);
+  ctx->suspend = UBASIC_RUN_YIELD;
+}
+/*---------------------------------------------------------------------------*/
+static void wait_statement(void) {
+  accept(TOKENIZER_WAIT);
+  if(tokenizer_token() == TOKENIZER_EVENT) {
+    accept(TOKENIZER_EVENT);
+    ctx->suspend = UBASIC_RUN_WAIT_EVENT;
+  } else ctx->suspend = UBASIC_RUN_WAIT;
+  ctx->wait_argument = expr_int();
+  accept(TOKENIZER_CR);
 }
 /*---------------------------------------------------------------------------*/
 static void end_statement(void) {
   accept(TOKENIZER_END);
-  ended = 1;
+  ctx->ended = 1;
 }
 /*---------------------------------------------------------------------------*/
 static void statement(void) {
@@ -370,37 +988,404 @@ static void statement(void) {
   case TOKENIZER_GOSUB:    gosub_statement(); break;
   case TOKENIZER_RETURN:   return_statement(); break;
   case TOKENIZER_FOR:      for_statement(); break;
+  case TOKENIZER_PARALLEL: parallel_statement(); break;
   case TOKENIZER_PEEK:     peek_statement(); break;
   case TOKENIZER_POKE:     poke_statement(); break;
   case TOKENIZER_NEXT:     next_statement(); break;
   case TOKENIZER_END:      end_statement(); break;
+  case TOKENIZER_ON:       on_statement(); break;
+  case TOKENIZER_YIELD:    yield_statement(); break;
+  case TOKENIZER_WAIT:     wait_statement(); break;
   case TOKENIZER_LET:      accept(TOKENIZER_LET); /* Fall through */
-  case TOKENIZER_VARIABLE: let_statement(); break;
+  case TOKENIZER_VARIABLE:
+  case TOKENIZER_STRINGVARIABLE: let_statement(); break;
   default:
-    circle_basic_print("Unknown statement\n");
-    HALT();
+    basic_error("Unknown statement\n");
+  }
+}
+/*---------------------------------------------------------------------------*/
+enum {
+  FUSED_NONE,
+  FUSED_ADD,     /* let x = x + c, or - c */
+  FUSED_IF_GOTO, /* if v <relation> c then goto n */
+  FUSED_NEXT,    /* next v */
+};
+
+static void fused_statement(struct ubasic_line_index *line) {
+  TRACE_LINE(line->line_number, line->token);
+  STATS_INC(statements[line->token]);
+  STATS_INC(fused);
+  switch(line->op) {
+  case FUSED_ADD:
+    ctx->variables[line->variable] += line->constant;
+    TRACE_SET(line->variable, ctx->variables[line->variable]);
+    break;
+  case FUSED_IF_GOTO:
+    if(apply(line->relation, ctx->variables[line->variable], line->constant)) {
+      jump_line_slot(line->target, line->target_slot);
+      return;
+    }
+    break;
+  case FUSED_NEXT:
+    if(for_next(line->variable)) return;
+    break;
   }
+  tokenizer_goto(line->next_line);
 }
 /*---------------------------------------------------------------------------*/
 static void line_statement(void) {
-  index_add(tokenizer_num(), tokenizer_pos());
+  struct ubasic_line_index *line;
+  int slot = ctx->line_slot, linenum;
+
+  /* Lines usually follow each other in the index, so the next line's
+     entry is found without a search */
+  if(slot >= 0 && slot < ctx->line_index_current_ptr &&
+     ctx->line_index_table[slot].program_text_position == tokenizer_pos()) {
+    line = &ctx->line_index_table[slot];
+    ctx->line_slot = slot + 1;
+    if(line->op != FUSED_NONE) {
+      fused_statement(line);
+      return;
+    }
+    linenum = line->line_number;
+  } else {
+    linenum = number();
+    slot = index_add(linenum, tokenizer_pos());
+    ctx->line_slot = slot >= 0 ? slot + 1 : -1;
+  }
   accept(TOKENIZER_NUMBER);
+  TRACE_LINE(linenum, tokenizer_token());
+  STATS_INC(statements[tokenizer_token()]);
   statement();
 }
 /*---------------------------------------------------------------------------*/
-void ubasic_run(void) {
-  if(!tokenizer_finished() && !ended) line_statement();
+#if UBASIC_STATS
+#define STATS_COPY(f) (dest->f = atomic_load_explicit(&context->stats.f, memory_order_relaxed))
+int ubasic_stats_snapshot(struct ubasic_context *context, struct ubasic_stats *dest) {
+  int i;
+  for(i = 0; i < TOKENIZER_NUM_TOKENS; i++) STATS_COPY(statements[i]);
+  STATS_COPY(jumps);
+  STATS_COPY(slow_jumps);
+  STATS_COPY(index_hits);
+  STATS_COPY(index_misses);
+  STATS_COPY(fused);
+  STATS_COPY(events);
+  STATS_COPY(print_calls);
+  STATS_COPY(peek_calls);
+  STATS_COPY(poke_calls);
+  STATS_COPY(max_gosub_depth);
+  STATS_COPY(max_for_depth);
+  return 1;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+#if UBASIC_TRACE
+int ubasic_trace_copy(struct ubasic_trace_record *dest, int max) {
+  unsigned int count = ctx->trace_head, i;
+  if(count > UBASIC_TRACE_RECORDS) count = UBASIC_TRACE_RECORDS;
+  if(max < 0) max = 0;
+  if(count > (unsigned int)max) count = max;
+  for(i = 0; i < count; i++) {
+    dest[i] = ctx->trace[(ctx->trace_head - count + i) & (UBASIC_TRACE_RECORDS - 1)];
+  }
+  return count;
+}
+#endif
+/*---------------------------------------------------------------------------*/
+static int fuse_accept(int token) {
+  if(tokenizer_token() != token) return 0;
+  tokenizer_next();
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static int fuse_constant(int *value) {
+  if(tokenizer_token() != TOKENIZER_NUMBER || tokenizer_num_overflow()) return 0;
+  *value = tokenizer_num();
+  tokenizer_next();
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+/* Recognizes a line that has a fused form, starting at its statement
+   token. Stops before the final CR so the caller can skip the line. */
+static void fuse_line(struct ubasic_line_index *line) {
+  int var, relation, constant, target;
+  line->op = FUSED_NONE;
+  line->token = tokenizer_token();
+  switch(tokenizer_token()) {
+  case TOKENIZER_LET:
+    tokenizer_next();
+    /* Fall through */
+  case TOKENIZER_VARIABLE:
+    var = tokenizer_variable_num();
+    if(!fuse_accept(TOKENIZER_VARIABLE) || !fuse_accept(TOKENIZER_EQ) ||
+       tokenizer_token() != TOKENIZER_VARIABLE || tokenizer_variable_num() != var) return;
+    tokenizer_next();
+    relation = tokenizer_token();
+    if(relation != TOKENIZER_PLUS && relation != TOKENIZER_MINUS) return;
+    tokenizer_next();
+    if(!fuse_constant(&constant) || tokenizer_token() != TOKENIZER_CR) return;
+    line->op = FUSED_ADD;
+    line->constant = relation == TOKENIZER_MINUS ? -constant : constant;
+    break;
+  case TOKENIZER_IF:
+    tokenizer_next();
+    var = tokenizer_variable_num();
+    if(!fuse_accept(TOKENIZER_VARIABLE)) return;
+    relation = tokenizer_token();
+    if(relation < TOKENIZER_LT || relation > TOKENIZER_NE) return;
+    tokenizer_next();
+    if(!fuse_constant(&constant) || !fuse_accept(TOKENIZER_THEN) ||
+       !fuse_accept(TOKENIZER_GOTO) || !fuse_constant(&target) ||
+       tokenizer_token() != TOKENIZER_CR) return;
+    line->op = FUSED_IF_GOTO;
+    line->relation = relation;
+    line->constant = constant;
+    line->target = target;
+    line->target_slot = -1;
+    break;
+  case TOKENIZER_NEXT:
+    tokenizer_next();
+    var = tokenizer_variable_num();
+    if(!fuse_accept(TOKENIZER_VARIABLE) || tokenizer_token() != TOKENIZER_CR) return;
+    line->op = FUSED_NEXT;
+    break;
+  default:
+    return;
+  }
+  line->variable = var;
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_preload(void) {
+  struct ubasic_line_index *line;
+  char const *pos;
+  int complete = 1, slot, i;
+  tokenizer_init(ctx->program_ptr);
+  while(tokenizer_token() == TOKENIZER_NUMBER && !tokenizer_num_overflow()) {
+    pos = tokenizer_pos();
+    slot = index_add(tokenizer_num(), pos);
+    if(slot < 0) {
+      complete = 0;
+      break;
+    }
+    tokenizer_next();
+    /* Of duplicate line numbers, only the first is ever jumped to */
+    line = &ctx->line_index_table[slot];
+    if(line->program_text_position != pos) {
+      if(!skip_to_next_line()) break;
+      continue;
+    }
+    fuse_line(line);
+    if(!skip_to_next_line()) {
+      line->op = FUSED_NONE;
+      break;
+    }
+    line->next_line = tokenizer_pos();
+  }
+
+  /* Jump targets get their slots once all lines are in place */
+  for(i = 0; i < ctx->line_index_current_ptr; i++) {
+    line = &ctx->line_index_table[i];
+    if(line->op == FUSED_IF_GOTO) {
+      slot = index_search(line->target);
+      if(slot < ctx->line_index_current_ptr &&
+         ctx->line_index_table[slot].line_number == line->target) line->target_slot = slot;
+    }
+  }
+  tokenizer_init(ctx->program_ptr);
+  ctx->line_slot = 0;
+  return complete;
+}
+/*---------------------------------------------------------------------------*/
+unsigned long ubasic_measure(const char *program, struct ubasic_layout *layout) {
+  struct tokenizer_state scan;
+  unsigned long for_variables = 0;
+  int line_start = 1, has_for = 0, events = 0, ifs = 0, i;
+
+  memset(layout, 0, sizeof(*layout));
+  tokenizer_set_state(&scan);
+  tokenizer_init(program);
+  while(tokenizer_token() != TOKENIZER_ENDOFINPUT && tokenizer_token() != TOKENIZER_ERROR) {
+    switch(tokenizer_token()) {
+    case TOKENIZER_NUMBER:
+      if(line_start) layout->lines++;
+      break;
+    case TOKENIZER_FOR:
+      has_for = 1;
+      tokenizer_next();
+      if(tokenizer_token() == TOKENIZER_VARIABLE) {
+        for_variables |= 1UL << tokenizer_variable_num();
+      }
+      break;
+    /* Without recursion, each call site is on the stack at most once */
+    case TOKENIZER_GOSUB:
+      layout->gosub_depth++;
+      break;
+    case TOKENIZER_EVENT:
+      events = 1;
+      break;
+    case TOKENIZER_IF:
+      ifs++;
+      break;
+    }
+    line_start = tokenizer_token() == TOKENIZER_CR;
+    tokenizer_next();
+  }
+  tokenizer_set_state(&ctx->tokenizer);
+
+  /* An event handler can be entered below any other frame */
+  layout->gosub_depth += events;
+  /* Jumps and NEXT inside IF make the nesting in the text meaningless,
+     but FOR reuses the frame of its variable, so there is at most one
+     frame per loop variable */
+  for(i = 0; i < MAX_VARNUM; i++) {
+    if(for_variables & (1UL << i)) layout->for_depth++;
+  }
+  if(has_for && layout->for_depth < MAX_FOR_STACK_DEPTH) layout->for_depth = MAX_FOR_STACK_DEPTH;
+  layout->if_skips = 1;
+  while(layout->if_skips < ifs && layout->if_skips < MAX_IF_SKIPS) layout->if_skips <<= 1;
+
+  layout->line_index_bytes = layout->lines * sizeof(struct ubasic_line_index);
+  layout->if_skip_bytes = layout->if_skips * sizeof(struct ubasic_if_skip);
+  layout->for_bytes = layout->for_depth * sizeof(struct ubasic_for_state);
+  layout->gosub_bytes = layout->gosub_depth * sizeof(int);
+  layout->table_bytes = layout->line_index_bytes + layout->if_skip_bytes +
+    layout->for_bytes + layout->gosub_bytes;
+  layout->context_bytes = sizeof(struct ubasic_context);
+  return layout->table_bytes;
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_init_mem(const char *program, const struct ubasic_layout *layout,
+                    void *mem, unsigned long size) {
+  struct ubasic_layout measured;
+  char *p = mem;
+
+  if(layout == (void*)0) {
+    ubasic_measure(program, &measured);
+    layout = &measured;
+  }
+  if((unsigned long)mem % _Alignof(struct ubasic_line_index) != 0) return 0;
+  if(layout->lines < 0 || layout->gosub_depth < 0 || layout->for_depth < 0 ||
+     layout->if_skips < 0 || (layout->if_skips & (layout->if_skips - 1)) != 0) return 0;
+  if((unsigned long)layout->lines * sizeof(struct ubasic_line_index) +
+     (unsigned long)layout->if_skips * sizeof(struct ubasic_if_skip) +
+     (unsigned long)layout->for_depth * sizeof(struct ubasic_for_state) +
+     (unsigned long)layout->gosub_depth * sizeof(int) > size) return 0;
+
+  /* Most strictly aligned first, so no padding is needed */
+  ctx->line_index_table = (struct ubasic_line_index *)p;
+  ctx->line_index_size = layout->lines;
+  p += layout->lines * sizeof(struct ubasic_line_index);
+  ctx->if_skips = (struct ubasic_if_skip *)p;
+  ctx->if_skips_size = layout->if_skips;
+  p += layout->if_skips * sizeof(struct ubasic_if_skip);
+  ctx->for_stack = (struct ubasic_for_state *)p;
+  ctx->for_stack_size = layout->for_depth;
+  p += layout->for_depth * sizeof(struct ubasic_for_state);
+  ctx->gosub_stack = (int *)p;
+  ctx->gosub_stack_size = layout->gosub_depth;
+
+  ubasic_init(program);
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_event_push(struct ubasic_context *context, int event) {
+  unsigned int tail = atomic_load_explicit(&context->event_tail, memory_order_relaxed);
+  unsigned int head = atomic_load_explicit(&context->event_head, memory_order_acquire);
+  if(tail - head >= MAX_EVENT_QUEUE) return 0;
+  context->event_queue[tail & (MAX_EVENT_QUEUE - 1)] = event;
+  atomic_store_explicit(&context->event_tail, tail + 1, memory_order_release);
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static void event_dispatch(void) {
+  unsigned int head = atomic_load_explicit(&ctx->event_head, memory_order_relaxed);
+  int event, i;
+  /* Handlers start on a line boundary; until then the event stays queued */
+  if(tokenizer_token() != TOKENIZER_NUMBER) return;
+  if(head == atomic_load_explicit(&ctx->event_tail, memory_order_acquire)) return;
+  event = ctx->event_queue[head & (MAX_EVENT_QUEUE - 1)];
+  atomic_store_explicit(&ctx->event_head, head + 1, memory_order_release);
+
+  /* Events without a handler are dropped */
+  for(i = 0; i < ctx->event_handlers_ptr; i++) {
+    if(ctx->event_handlers[i].event == event) break;
+  }
+  if(i == ctx->event_handlers_ptr) return;
+  STATS_INC(events);
+  gosub_jump(ctx->event_handlers[i].line_number);
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_run(void) {
+  if(tokenizer_finished() || ctx->ended) return UBASIC_RUN_END;
+  event_dispatch();
+  ctx->suspend = UBASIC_RUN_OK;
+  line_statement();
+  if(ctx->suspend != UBASIC_RUN_OK) return ctx->suspend;
+  return ubasic_finished() ? UBASIC_RUN_END : UBASIC_RUN_OK;
 }
 /*---------------------------------------------------------------------------*/
 int ubasic_finished(void) {
-  return ended || tokenizer_finished();
+  return ctx->ended || tokenizer_finished();
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_wait_argument(void) {
+  return ctx->wait_argument;
 }
 /*---------------------------------------------------------------------------*/
 void ubasic_set_variable(int varnum, VARIABLE_TYPE value) {
-  if(varnum >= 0 && varnum < MAX_VARNUM) variables[varnum] = value;
+  if(ctx->variables == (void*)0) ctx->variables = ctx->variable_storage;
+  if(varnum >= 0 && varnum < MAX_VARNUM) ctx->variables[varnum] = value;
+}
+/*---------------------------------------------------------------------------*/
+void ubasic_set_string_arena(char *arena, int size) {
+  ctx->string_arena = arena;
+  ctx->string_arena_size = arena != (void*)0 ? size : 0;
+  ctx->string_arena_used = 0;
+}
+/*---------------------------------------------------------------------------*/
+char const *ubasic_get_string_variable(int varnum, int *len) {
+  if(varnum >= 0 && varnum < MAX_VARNUM) {
+    *len = ctx->strings[varnum].len;
+    return ctx->strings[varnum].ptr;
+  }
+  *len = 0;
+  return (void*)0;
 }
 /*---------------------------------------------------------------------------*/
 VARIABLE_TYPE ubasic_get_variable(int varnum) {
-  if(varnum >= 0 && varnum < MAX_VARNUM) return variables[varnum];
+  if(ctx->variables == (void*)0) ctx->variables = ctx->variable_storage;
+  if(varnum >= 0 && varnum < MAX_VARNUM) return ctx->variables[varnum];
   return 0;
 }
+/*---------------------------------------------------------------------------*/
+int ubasic_bind_variables(VARIABLE_TYPE *storage) {
+  if(storage == (void*)0) storage = ctx->variable_storage;
+  if((unsigned long)storage % _Alignof(VARIABLE_TYPE) != 0) return 0;
+  ctx->variables = storage;
+  return 1;
+}
+/*---------------------------------------------------------------------------*/
+static int clamp_range(int *first, int count) {
+  if(*first < 0) {
+    count += *first;
+    *first = 0;
+  }
+  if(count > MAX_VARNUM - *first) count = MAX_VARNUM - *first;
+  return count > 0 ? count : 0;
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_get_variables(VARIABLE_TYPE *dest, int first, int count) {
+  int skipped = first < 0 ? -first : 0;
+  if(ctx->variables == (void*)0) ctx->variables = ctx->variable_storage;
+  count = clamp_range(&first, count);
+  memcpy(dest + skipped, ctx->variables + first, count * sizeof(VARIABLE_TYPE));
+  return count;
+}
+/*---------------------------------------------------------------------------*/
+int ubasic_set_variables(const VARIABLE_TYPE *src, int first, int count) {
+  int skipped = first < 0 ? -first : 0;
+  if(ctx->variables == (void*)0) ctx->variables = ctx->variable_storage;
+  count = clamp_range(&first, count);
+  memcpy(ctx->variables + first, src + skipped, count * sizeof(VARIABLE_TYPE));
+  return count;
+}
@@ -31,16 +31,331 @@
 #define __UBASIC_H__
 
 #include "vartype.h"
+#include "tokenizer.h"
+#include <stdatomic.h>
 
 typedef VARIABLE_TYPE (*peek_func)(VARIABLE_TYPE);
 typedef void (*poke_func)(VARIABLE_TYPE, VARIABLE_TYPE);
+typedef void (*print_func)(const char *s, int len);
+typedef void (*error_func)(const char *message);
+
+struct ubasic_parallel_job;
+typedef void (*parallel_func)(struct ubasic_parallel_job *job, int from, int to);
+
+#define MAX_GOSUB_STACK_DEPTH 10
+#define MAX_FOR_STACK_DEPTH 4
+#define MAX_LINE_INDEXES 256
+#define MAX_EVENT_QUEUE 16 /* Must be a power of two */
+#define MAX_EVENT_HANDLERS 8
+#define MAX_VARNUM 26
+#define MAX_IF_SKIPS 32 /* Must be a power of two */
+
+/* Every context carries stacks, line index and IF cache of the MAX_ sizes
+   above for ubasic_init(). Build with -DUBASIC_DEFAULT_TABLES=0 to leave
+   them out and size each context's tables from its program with
+   ubasic_init_mem() instead. */
+#ifndef UBASIC_DEFAULT_TABLES
+#define UBASIC_DEFAULT_TABLES 1
+#endif
+
+/* Build with -DUBASIC_TRACE=1 to record every executed line in a ring
+   buffer inside the context. When disabled the tracer compiles to
+   nothing. */
+#ifndef UBASIC_TRACE
+#define UBASIC_TRACE 0
+#endif
+#define UBASIC_TRACE_RECORDS 1024 /* Must be a power of two */
+
+/* Runtime counters, on unless built with -DUBASIC_STATS=0 */
+#ifndef UBASIC_STATS
+#define UBASIC_STATS 1
+#endif
+
+struct ubasic_for_state {
+  int line_after_for;
+  int line_after_for_slot; /* Its line index entry, if known, or -1 */
+  int for_variable;
+  int to;
+  int step;
+};
+
+/* Line index entries, kept sorted by line number. ubasic_preload() also
+   records lines of the forms `let x = x + c`, `if v < c then goto n` and
+   `next v` as one fused operation that runs without parsing the line. */
+struct ubasic_line_index {
+  int line_number;
+  unsigned char op;       /* Fused operation, 0 for none */
+  unsigned char token;    /* Statement token, for stats and trace */
+  unsigned char variable;
+  unsigned char relation;
+  char const *program_text_position;
+  char const *next_line;  /* Where a fused line continues */
+  int constant;
+  int target;             /* Line number jumped to */
+  int target_slot;        /* Its entry in the index, or -1 */
+};
+
+/* String values are slices of the program text or of the string arena */
+struct ubasic_string {
+  char const *ptr;
+  int len;
+};
+
+/* Where execution continues when the condition of the IF at if_pos is
+   false: the statement after ELSE, or the start of the next line */
+struct ubasic_if_skip {
+  char const *if_pos;
+  char const *target;
+  int has_else;
+};
+
+struct ubasic_event_handler {
+  int event;
+  int line_number;
+};
+
+struct ubasic_trace_record {
+  int line_number;
+  int target;               /* Line jumped to, or -1 */
+  int value;                /* Value stored in variable */
+  unsigned char token;      /* Statement token */
+  unsigned char variable;   /* Variable modified, or 0xff */
+  unsigned short reserved;
+};
+
+struct ubasic_stats {
+  unsigned long statements[TOKENIZER_NUM_TOKENS]; /* By statement token */
+  unsigned long jumps;        /* Taken GOTO, GOSUB, RETURN, NEXT, events */
+  unsigned long slow_jumps;   /* Jumps that rescanned the program */
+  unsigned long index_hits;
+  unsigned long index_misses;
+  unsigned long fused;        /* Lines run as a fused operation */
+  unsigned long events;       /* Events dispatched to a handler */
+  unsigned long print_calls;
+  unsigned long peek_calls;
+  unsigned long poke_calls;
+  int max_gosub_depth;
+  int max_for_depth;
+};
+
+/* The live counters in a context: the fields of struct ubasic_stats,
+   written only by the thread running the context and read by
+   ubasic_stats_snapshot() from any other, both with relaxed atomics */
+struct ubasic_stats_counters {
+  atomic_ulong statements[TOKENIZER_NUM_TOKENS];
+  atomic_ulong jumps;
+  atomic_ulong slow_jumps;
+  atomic_ulong index_hits;
+  atomic_ulong index_misses;
+  atomic_ulong fused;
+  atomic_ulong events;
+  atomic_ulong print_calls;
+  atomic_ulong peek_calls;
+  atomic_ulong poke_calls;
+  atomic_int max_gosub_depth;
+  atomic_int max_for_depth;
+};
+
+/* Table sizes for one program and the memory they take. Counts are
+   entries; bytes are exact, with no padding between tables. */
+struct ubasic_layout {
+  int lines;        /* Line index */
+  int gosub_depth;  /* GOSUB stack, including event handlers */
+  int for_depth;    /* FOR stack */
+  int if_skips;     /* IF skip cache, a power of two */
+  unsigned long line_index_bytes;
+  unsigned long gosub_bytes;
+  unsigned long for_bytes;
+  unsigned long if_skip_bytes;
+  unsigned long table_bytes;   /* Memory ubasic_init_mem() needs */
+  unsigned long context_bytes; /* sizeof(struct ubasic_context) */
+};
+
+/* Trace files are this header followed by count records, oldest first */
+#define UBASIC_TRACE_MAGIC 0x52544255 /* "UBTR" */
+struct ubasic_trace_header {
+  unsigned int magic;
+  unsigned int record_size;
+  unsigned int count;
+  unsigned int reserved;
+};
+
+/* Complete state of one interpreter. A host may keep any number of these
+   and switch between them with ubasic_select(); nothing is lost when a
+   suspended program is resumed later. */
+struct ubasic_context {
+  struct tokenizer_state tokenizer;
+  char const *program_ptr;
+
+  /* Tables point into the default storage below, a host table or the
+     memory given to ubasic_init_mem() */
+  int *gosub_stack;
+  int gosub_stack_size;
+  int gosub_stack_ptr;
+
+  struct ubasic_for_state *for_stack;
+  int for_stack_size;
+  int for_stack_ptr;
+
+  struct ubasic_line_index *line_index_table;
+  int line_index_size;
+  int line_index_current_ptr;
+  int line_slot; /* Expected index entry of the next line */
+
+  struct ubasic_if_skip *if_skips;
+  int if_skips_size;
+
+#if UBASIC_DEFAULT_TABLES
+  int gosub_stack_storage[MAX_GOSUB_STACK_DEPTH];
+  struct ubasic_for_state for_stack_storage[MAX_FOR_STACK_DEPTH];
+  struct ubasic_line_index line_index_storage[MAX_LINE_INDEXES];
+  struct ubasic_if_skip if_skips_storage[MAX_IF_SKIPS];
+#endif
+
+  /* Pending host events: a single-producer/single-consumer ring. The host
+     pushes from one thread or interrupt handler, the interpreter pops one
+     event per line boundary. */
+  int event_queue[MAX_EVENT_QUEUE];
+  atomic_uint event_head, event_tail;
+  struct ubasic_event_handler event_handlers[MAX_EVENT_HANDLERS];
+  int event_handlers_ptr;
+
+  VARIABLE_TYPE *variables; /* variable_storage or bound host memory */
+  VARIABLE_TYPE variable_storage[MAX_VARNUM];
+
+  struct ubasic_string strings[MAX_VARNUM];
+  char *string_arena;
+  int string_arena_size;
+  int string_arena_used;
+
+#if UBASIC_STATS
+  struct ubasic_stats_counters stats;
+#endif
+
+#if UBASIC_TRACE
+  struct ubasic_trace_record trace[UBASIC_TRACE_RECORDS];
+  unsigned int trace_head;
+  struct ubasic_trace_record *trace_record; /* The current line's */
+#endif
+
+  int ended;
+  int suspend;
+  int wait_argument;
+};
+
+/* Return values of ubasic_run() */
+enum {
+  UBASIC_RUN_OK,         /* A line was executed */
+  UBASIC_RUN_YIELD,      /* YIELD: the program is ready to continue */
+  UBASIC_RUN_WAIT,       /* WAIT n: sleep for ubasic_wait_argument() ticks */
+  UBASIC_RUN_WAIT_EVENT, /* WAIT EVENT n: block until the host signals n */
+  UBASIC_RUN_END,        /* The program has finished */
+};
+
+void ubasic_select(struct ubasic_context *context);
+struct ubasic_context *ubasic_current(void);
 
 void ubasic_init(const char *program);
-void ubasic_run(void);
+
+/* Compute the tables program needs. Recursive programs and event handlers
+   that can interrupt each other need more GOSUB depth than can be seen in
+   the text; raise gosub_depth for them. FOR depth cannot be read from the
+   text either: it is one frame per loop variable, at least
+   MAX_FOR_STACK_DEPTH, and may be raised the same way. Returns
+   layout->table_bytes. */
+unsigned long ubasic_measure(const char *program, struct ubasic_layout *layout);
+
+/* Like ubasic_init(), but carve the current context's stacks, line index
+   and IF cache out of mem, sized by layout or, if it is NULL, by
+   ubasic_measure(). mem must be aligned for a pointer. Returns 0, leaving
+   the context untouched, if the tables do not fit in size bytes. The
+   tables stay in use across later calls to ubasic_init(); a GOSUB or FOR
+   beyond their depth stops the program with an error. */
+int ubasic_init_mem(const char *program, const struct ubasic_layout *layout,
+                    void *mem, unsigned long size);
+void ubasic_init_peek_poke(const char *program, peek_func peek, poke_func poke);
+
+/* Index every line of the program up front, so that no jump has to
+   rescan the program text. Call right after ubasic_init(). Returns 0 if
+   the line index filled up before the end of the program. */
+int ubasic_preload(void);
+
+/* Use table, an array of size entries owned by the host, as the line index
+   of the current context instead of its own MAX_LINE_INDEXES entries, for
+   programs with more lines than that. NULL switches back. Like bound
+   variables, the table stays in use across ubasic_init(). */
+void ubasic_set_line_index(struct ubasic_line_index *table, int size);
+
+/* Copy the complete state of src into dest; dest gets its own copy of the
+   variables even if src's are bound to host memory. dest keeps its own
+   stacks and IF cache (from ubasic_init_mem() or the default storage) and
+   src's frames are copied into them; returns 0 if they do not fit. A line
+   index outside src's default storage is shared read-only: dest finds
+   lines src had not indexed by rescanning, so preload src first. */
+int ubasic_clone(struct ubasic_context *dest, const struct ubasic_context *src);
+int ubasic_run(void);
 int ubasic_finished(void);
+int ubasic_wait_argument(void);
 
 VARIABLE_TYPE ubasic_get_variable(int varnum);
 void ubasic_set_variable(int varum, VARIABLE_TYPE value);
 void ubasic_set_poke_function(void (*f)(VARIABLE_TYPE, VARIABLE_TYPE));
 
+/* Make storage, an array of MAX_VARNUM values owned by the host, the
+   variables of the current context, so results can be read and written in
+   place. NULL switches back to the context's own array. Returns 0 if
+   storage is misaligned. */
+int ubasic_bind_variables(VARIABLE_TYPE *storage);
+
+/* Copy count variables starting at first out of or into the current
+   context in one call. Returns the number of variables copied. */
+int ubasic_get_variables(VARIABLE_TYPE *dest, int first, int count);
+int ubasic_set_variables(const VARIABLE_TYPE *src, int first, int count);
+
+/* Called with a message on fatal errors instead of stopping forever; the
+   host may longjmp() out of it and discard the context. */
+void ubasic_set_error_function(error_func f);
+
+/* With a print function installed, PRINT passes every piece of output to
+   it as a slice, string literals straight from the program text. Without
+   one, output goes through circle_basic_print(). */
+void ubasic_set_print_function(print_func f);
+
+/* String variables (A$ to Z$) built by concatenation are bump-allocated
+   from arena, which is reset by ubasic_init(). Assigning a literal or
+   another string variable uses no arena space. */
+void ubasic_set_string_arena(char *arena, int size);
+char const *ubasic_get_string_variable(int varnum, int *len);
+
+/* PARALLEL FOR hands the iteration range to f, which must split it into
+   chunks, call ubasic_parallel_chunk() for each chunk with a context of
+   its own (usually one per worker thread) and return once all chunks are
+   done. Without f, or when the loop body does more than POKE under an
+   optional IF, PARALLEL FOR runs as an ordinary FOR loop. An error in a
+   chunk ends that chunk and is reported on the thread running the loop
+   once f returns. */
+void ubasic_set_parallel_function(parallel_func f);
+void ubasic_parallel_chunk(struct ubasic_parallel_job *job,
+                           struct ubasic_context *worker, int from, int to);
+
+/* Queue an event for the program running in context. Safe to call from
+   one producer thread or interrupt handler concurrently with ubasic_run().
+   The handler bound with ON EVENT ... GOSUB runs before the next line.
+   Returns 0 if the queue is full. */
+int ubasic_event_push(struct ubasic_context *context, int event);
+
+#if UBASIC_STATS
+/* Copy the counters of context to dest without stopping the interpreter;
+   may be called from any thread. Each counter is read whole, but while
+   the program runs they are read one after another, so counters that
+   change together may be one update apart. Always returns 1. */
+int ubasic_stats_snapshot(struct ubasic_context *context, struct ubasic_stats *dest);
+#endif
+
+#if UBASIC_TRACE
+/* Copy up to max of the most recent trace records to dest, oldest first.
+   Returns the number of records copied. */
+int ubasic_trace_copy(struct ubasic_trace_record *dest, int max);
+#endif
+
 #endif /* __UBASIC_H__ */
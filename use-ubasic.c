@@ -29,6 +29,9 @@
  */
 
 #include "ubasic.h"
+#if UBASIC_TRACE
+#include <stdio.h>
+#endif
 
 static const char program[] =
 "10 gosub 100\n\
@@ -40,6 +43,27 @@ static const char program[] =
 100 print \"subroutine\"\n\
 110 return\n";
 
+#if UBASIC_TRACE
+static struct ubasic_trace_record trace[UBASIC_TRACE_RECORDS];
+
+/*---------------------------------------------------------------------------*/
+static void
+write_trace(const char *filename)
+{
+  struct ubasic_trace_header header;
+  FILE *f;
+
+  header.magic = UBASIC_TRACE_MAGIC;
+  header.record_size = sizeof(struct ubasic_trace_record);
+  header.count = ubasic_trace_copy(trace, UBASIC_TRACE_RECORDS);
+  header.reserved = 0;
+  f = fopen(filename, "wb");
+  if(f == NULL) return;
+  fwrite(&header, sizeof(header), 1, f);
+  fwrite(trace, sizeof(trace[0]), header.count, f);
+  fclose(f);
+}
+#endif
 /*---------------------------------------------------------------------------*/
 int
 main(void)
@@ -50,6 +74,10 @@ main(void)
     ubasic_run();
   } while(!ubasic_finished());
 
+#if UBASIC_TRACE
+  write_trace("ubasic.trace");
+#endif
+
   return 0;
 }
 /*---------------------------------------------------------------------------*/